@@ -0,0 +1,58 @@
+import random
+import execorder
+
+# Objects of classes defined by the code, mutated over several milestones
+code = '''
+class P:
+    pass
+
+class Holder:
+    pass
+
+p = P()
+ps = [P(), P()]
+h = Holder()
+h.gen = (x for x in range(3))
+X = [0] * 10
+for i in range(20000):
+    p.a = i
+    ps[i % 2].b = [i]
+    X[i % 10] = i
+    h.n = i
+'''
+
+# States computed the plain way: a recording that keeps no replayed milestones
+reference = execorder.exec(code)
+reference.cache_bytes = 0
+N = reference.steps()
+
+def shown(state):
+    shown = {}
+    for name, value in state.items():
+        if name in ('p', 'ps', 'X', 'i'):
+            shown[name] = repr(value if name != 'p' else vars(value))
+    if 'ps' in state:
+        shown['ps'] = repr([vars(q) for q in state['ps']])
+    return shown
+
+steps = random.Random(1).sample(range(N), 300)
+expected = {n: shown(reference.state(n)) for n in steps}
+
+# Right after p.a = i, the replayed p holds this step's i, not its final value
+lines = code.split('\n')
+for n in steps:
+    if n > 0 and lines[reference.line(n - 1) - 1].strip() == 'p.a = i':
+        state = reference.state(n)
+        assert state['p'].a == state['i'], (n, state['p'].a, state['i'])
+
+# The same states in random order, keeping plenty of milestones, a few, and none
+for cache_bytes in (32 << 20, 4096, 0):
+    recording = execorder.exec(code)
+    recording.cache_bytes = cache_bytes
+    for n in steps:
+        state = recording.state(n)
+        assert shown(state) == expected[n], (cache_bytes, n, shown(state), expected[n])
+        if 'h' in state:
+            assert type(state['h']).__name__ == 'Holder', n
+
+print('OK')
@@ -0,0 +1,570 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+
+/*
+    Append-only columns used to store one value per execution step.
+
+    Values live in fixed size chunks, so growing a column only ever allocates
+    a new chunk - the history already recorded is never moved or copied.
+*/
+
+// ==== class Column ====================
+template<typename T, size_t CHUNK_BITS = 14>
+class Column {
+public:
+    static const size_t CHUNK_SIZE = (size_t)1 << CHUNK_BITS;
+
+    void push_back(T value){
+        if((length & MASK) == 0){
+            chunks.emplace_back(new T[CHUNK_SIZE]);
+        }
+        chunks.back()[length & MASK] = value;
+        length++;
+    }
+
+    T operator[](size_t i) const {
+        return chunks[i >> CHUNK_BITS][i & MASK];
+    }
+
+    T& back(){
+        return chunks.back()[(length - 1) & MASK];
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    bool empty() const {
+        return length == 0;
+    }
+
+    size_t memory() const {
+        return chunks.size() * CHUNK_SIZE * sizeof(T);
+    }
+
+    void clear(){
+        std::vector<std::unique_ptr<T[]>>().swap(chunks);
+        length = 0;
+    }
+
+private:
+    static const size_t MASK = CHUNK_SIZE - 1;
+    std::vector<std::unique_ptr<T[]>> chunks;
+    size_t length = 0;
+};
+
+// ==== class PackedColumn ====================
+// Column of small unsigned values, BITS bits each, packed into 64 bit words
+template<unsigned BITS>
+class PackedColumn {
+public:
+    static const unsigned PER_WORD = 64 / BITS;
+
+    void push_back(unsigned value){
+        if(length % PER_WORD == 0){
+            words.push_back(0);
+        }
+        words.back() |= (uint64_t)(value & MASK) << ((length % PER_WORD) * BITS);
+        length++;
+    }
+
+    unsigned operator[](size_t i) const {
+        return (unsigned)(words[i / PER_WORD] >> ((i % PER_WORD) * BITS)) & MASK;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    size_t memory() const {
+        return words.memory();
+    }
+
+    void clear(){
+        words.clear();
+        length = 0;
+    }
+
+private:
+    static const uint64_t MASK = ((uint64_t)1 << BITS) - 1;
+    Column<uint64_t, 12> words;
+    size_t length = 0;
+};
+
+// ==== class PatternColumn ====================
+/*
+    Column compressed in blocks of BLOCK values. A sealed block is a list of
+    runs, each repeating a short pattern (e.g. the lines of a loop body) until
+    the next run starts; values that don't repeat become a run of a pattern as
+    long as the run itself. Each distinct pattern is stored once per block and
+    runs are varint (pattern, length) pairs, so "pattern P x k iterations"
+    costs about two bytes. The newest, unsealed block is kept raw.
+
+    Lookups go straight to the block, binary search its sparse run index and
+    decode at most INDEX_EVERY runs.
+*/
+template<typename T>
+class PatternColumn {
+public:
+    static const size_t BLOCK = 4096;
+    static const size_t MAX_PERIOD = 32;
+    static const size_t INDEX_EVERY = 16;
+
+    void push_back(T value){
+        tail.push_back(value);
+        length++;
+        if(tail.size() == BLOCK){
+            seal();
+        }
+    }
+
+    T operator[](size_t i) const {
+        size_t b = i / BLOCK, j = i % BLOCK;
+        if(b == blocks.size()){
+            return tail[j];
+        }
+        auto& block = blocks[b];
+        size_t start, position;
+        seek(block, j, start, position);
+        while(true){
+            auto& pattern = block.patterns[read(block.runs, position)];
+            size_t run_length = read(block.runs, position);
+            if(j < start + run_length){
+                return block.pool[pattern.offset + (j - start) % pattern.period];
+            }
+            start += run_length;
+        }
+    }
+
+    // Call f(i, value) for each i in [from, to), decoding runs sequentially
+    template<typename F>
+    void each(size_t from, size_t to, F f) const {
+        to = std::min(to, length);
+        size_t i = from;
+        while(i < to){
+            size_t b = i / BLOCK, base = b * BLOCK;
+            if(b == blocks.size()){
+                for(; i < to; i++){
+                    f(i, tail[i - base]);
+                }
+                return;
+            }
+            auto& block = blocks[b];
+            size_t start, position, end = std::min(to, base + BLOCK);
+            seek(block, i - base, start, position);
+            while(i < end){
+                auto& pattern = block.patterns[read(block.runs, position)];
+                size_t run_end = base + start + read(block.runs, position);
+                for(; i < end && i < run_end; i++){
+                    f(i, block.pool[pattern.offset + (i - base - start) % pattern.period]);
+                }
+                start = run_end - base;
+            }
+        }
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    bool empty() const {
+        return length == 0;
+    }
+
+    size_t memory() const {
+        size_t total = tail.capacity() * sizeof(T) + blocks.capacity() * sizeof(Block);
+        for(auto& block : blocks){
+            total += block.pool.capacity() * sizeof(T) + block.patterns.capacity() * sizeof(Pattern)
+                   + block.runs.capacity() + block.index.capacity() * sizeof(IndexEntry);
+        }
+        return total;
+    }
+
+private:
+    struct Pattern {
+        uint32_t    offset;     // Offset of the pattern in the block's pool
+        uint32_t    period;
+    };
+
+    struct IndexEntry {
+        uint16_t    start;      // Offset in the block of the run
+        uint16_t    offset;     // Byte offset of the run in 'runs'
+    };
+
+    struct Block {
+        std::vector<T>              pool;
+        std::vector<Pattern>        patterns;
+        std::vector<unsigned char>  runs;
+        std::vector<IndexEntry>     index;
+    };
+
+    // Start and byte offset of the indexed run at or before offset j of the block
+    static void seek(const Block& block, size_t j, size_t& start, size_t& position){
+        size_t lo = 0, hi = block.index.size();    // index[lo].start <= j
+        while(hi - lo > 1){
+            size_t mid = (lo + hi) / 2;
+            if(block.index[mid].start <= j){
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        start = block.index[lo].start;
+        position = block.index[lo].offset;
+    }
+
+    void seal(){
+        Block block;
+        size_t n = tail.size(), i = 0, literal = n, run_count = 0;   // literal: start of pending non-repeating values
+        while(i < n){
+            // Find the period whose repetition starting at i covers the most values
+            size_t best_period = 0, best_end = i;
+            for(size_t p = 1; p <= MAX_PERIOD && i + 2 * p <= n; p++){
+                if(best_period && p % best_period == 0){
+                    continue;   // Multiples of a period never cover more
+                }
+                size_t end = i + p;
+                while(end < n && tail[end] == tail[end - p]){
+                    end++;
+                }
+                if(end - i >= 2 * p && end - p > best_end - best_period){
+                    best_period = p;
+                    best_end = end;
+                    if(end == n){
+                        break;
+                    }
+                }
+            }
+
+            if(best_period && best_end - i >= best_period + 2){
+                if(literal < i){
+                    add_run(block, run_count, literal, i - literal, i - literal);
+                }
+                add_run(block, run_count, i, best_period, best_end - i);
+                literal = n;
+                i = best_end;
+            } else {
+                literal = std::min(literal, i);
+                i++;
+            }
+        }
+        if(literal < n){
+            add_run(block, run_count, literal, n - literal, n - literal);
+        }
+
+        block.pool.shrink_to_fit();
+        block.patterns.shrink_to_fit();
+        block.runs.shrink_to_fit();
+        block.index.shrink_to_fit();
+        blocks.push_back(std::move(block));
+        tail.clear();
+    }
+
+    void add_run(Block& block, size_t& run_count, size_t start, size_t period, size_t run_length){
+        // Reuse an identical pattern from earlier in the block if there is one
+        size_t id = block.patterns.size();
+        auto first = tail.begin() + start;
+        for(size_t p = 0; p < block.patterns.size(); p++){
+            auto& pattern = block.patterns[p];
+            if(pattern.period == period && std::equal(first, first + period, block.pool.begin() + pattern.offset)){
+                id = p;
+                break;
+            }
+        }
+        if(id == block.patterns.size()){
+            block.patterns.push_back({(uint32_t)block.pool.size(), (uint32_t)period});
+            block.pool.insert(block.pool.end(), first, first + period);
+        }
+
+        if(run_count % INDEX_EVERY == 0){
+            block.index.push_back({(uint16_t)start, (uint16_t)block.runs.size()});
+        }
+        write(block.runs, id);
+        write(block.runs, run_length);
+        run_count++;
+    }
+
+    static void write(std::vector<unsigned char>& bytes, size_t value){
+        while(value >= 0x80){
+            bytes.push_back((unsigned char)(value | 0x80));
+            value >>= 7;
+        }
+        bytes.push_back((unsigned char)value);
+    }
+
+    static size_t read(const std::vector<unsigned char>& bytes, size_t& position){
+        size_t value = 0; unsigned shift = 0; unsigned char byte;
+        do {
+            byte = bytes[position++];
+            value |= (size_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while(byte & 0x80);
+        return value;
+    }
+
+    std::vector<Block>  blocks;
+    std::vector<T>      tail;
+    size_t              length = 0;
+};
+
+// ==== class MinimaColumn ====================
+/*
+    PatternColumn that also keeps the minimum of every FANOUT values, of every
+    FANOUT of those minima and so on up to a single minimum of the whole
+    column. Finding the next or previous value at most some limit climbs
+    these levels past everything above the limit, so it looks at
+    O(FANOUT log n) values rather than every value in between.
+*/
+template<typename T>
+class MinimaColumn {
+public:
+    static const size_t FANOUT = 64;
+    static const size_t NONE = (size_t)-1;
+
+    void push_back(T value){
+        size_t j = values.size();
+        values.push_back(value);
+        for(size_t k = 0; ; k++){
+            j /= FANOUT;
+            if(k == levels.size()){
+                levels.emplace_back();
+                if(k > 0){
+                    levels[k].push_back(levels[k - 1][0]);  // New top level covers everything so far
+                }
+            }
+            auto& level = levels[k];
+            if(j == level.size()){
+                level.push_back(value);
+            } else {
+                level[j] = std::min(level[j], value);
+            }
+            if(j == 0 && k + 1 == levels.size()){
+                break;
+            }
+        }
+    }
+
+    T operator[](size_t i) const {
+        return values[i];
+    }
+
+    // First i >= from with value <= limit, or NONE
+    size_t next_at_most(size_t from, T limit) const {
+        if(from >= values.size()){
+            return NONE;
+        }
+        size_t found = scan(from, std::min((from / FANOUT + 1) * FANOUT, values.size()), limit, true);
+        if(found != NONE){
+            return found;
+        }
+        // Move right along a level, going up whenever a group above is finished
+        size_t k = 0, j = from / FANOUT + 1;
+        while(true){
+            if(j >= levels[k].size()){
+                return NONE;
+            }
+            if(levels[k][j] <= limit){
+                break;
+            }
+            j++;
+            if(j % FANOUT == 0){
+                j /= FANOUT;
+                k++;
+                if(k == levels.size()){
+                    return NONE;
+                }
+            }
+        }
+        return descend(k, j, limit, true);
+    }
+
+    // Last i < before with value <= limit, or NONE
+    size_t prev_at_most(size_t before, T limit) const {
+        before = std::min(before, values.size());
+        if(before == 0){
+            return NONE;
+        }
+        size_t found = scan((before - 1) / FANOUT * FANOUT, before, limit, false);
+        if(found != NONE){
+            return found;
+        }
+        // Move left along a level, going up whenever a group above is finished
+        size_t k = 0, j = (before - 1) / FANOUT;
+        while(true){
+            if(j == 0){
+                return NONE;
+            }
+            if(j % FANOUT == 0){
+                j /= FANOUT;
+                k++;
+                continue;
+            }
+            j--;
+            if(levels[k][j] <= limit){
+                break;
+            }
+        }
+        return descend(k, j, limit, false);
+    }
+
+    size_t size() const {
+        return values.size();
+    }
+
+    size_t memory() const {
+        size_t bytes = values.memory();
+        for(auto& level : levels){
+            bytes += level.capacity() * sizeof(T);
+        }
+        return bytes;
+    }
+
+private:
+    // First (or last) i in [from, to) with value <= limit, or NONE
+    size_t scan(size_t from, size_t to, T limit, bool first) const {
+        size_t found = NONE;
+        values.each(from, to, [&](size_t i, T value){
+            if(value <= limit && (found == NONE || !first)){
+                found = i;
+            }
+        });
+        return found;
+    }
+
+    // First (or last) value <= limit under levels[k][j], which is known to have one
+    size_t descend(size_t k, size_t j, T limit, bool first) const {
+        while(k > 0){
+            k--;
+            size_t from = j * FANOUT, to = std::min(from + FANOUT, levels[k].size());
+            if(first){
+                for(j = from; levels[k][j] > limit; j++);
+            } else {
+                for(j = to - 1; levels[k][j] > limit; j--);
+            }
+        }
+        return scan(j * FANOUT, std::min((j + 1) * FANOUT, values.size()), limit, first);
+    }
+
+    PatternColumn<T>            values;
+    std::vector<std::vector<T>> levels;     // levels[k][j] is the minimum of values [j, j + 1) * FANOUT^(k + 1)
+};
+
+// ==== class TimeColumn ====================
+/*
+    Timestamps (in nanoseconds) of each step, stored as 16 bit deltas in units
+    of UNIT nanoseconds. A delta that doesn't fit is written as ESCAPE followed
+    by three words holding the full 48 bit delta. Every BLOCK steps the
+    absolute time and word offset are indexed, so a lookup decodes at most
+    one block.
+*/
+class TimeColumn {
+public:
+    static const uint64_t UNIT = 16;
+    static const size_t BLOCK = 1024;
+    static const uint16_t ESCAPE = 0xFFFF;
+
+    void push_back(uint64_t ns){
+        if(length == 0){
+            origin = ns;
+        }
+        uint64_t units = (ns - origin) / UNIT;
+        if(length % BLOCK == 0){
+            index.push_back({units, words.size()});
+        }
+        uint64_t delta = length == 0 ? 0 : units - last;
+        if(delta < ESCAPE){
+            words.push_back((uint16_t)delta);
+        } else {
+            words.push_back(ESCAPE);
+            words.push_back((uint16_t)delta);
+            words.push_back((uint16_t)(delta >> 16));
+            words.push_back((uint16_t)(delta >> 32));
+        }
+        last = units;
+        length++;
+    }
+
+    // Nanoseconds since the first step
+    uint64_t operator[](size_t i) const {
+        uint64_t ns = 0;
+        each(i, i + 1, [&](size_t, uint64_t t){ ns = t; });
+        return ns;
+    }
+
+    // Call f(i, nanoseconds since first step) for each step in [from, to)
+    template<typename F>
+    void each(size_t from, size_t to, F f) const {
+        to = std::min(to, length);
+        if(from >= to){
+            return;
+        }
+        uint64_t units = 0;
+        size_t position = 0;
+        for(size_t i = from - from % BLOCK; i < to; i++){
+            if(i % BLOCK != 0){
+                uint64_t delta = words[position++];
+                if(delta == ESCAPE){
+                    delta = (uint64_t)words[position] | (uint64_t)words[position + 1] << 16
+                          | (uint64_t)words[position + 2] << 32;
+                    position += 3;
+                }
+                units += delta;
+            } else {
+                // Block starts are absolute, skip over their delta
+                auto& entry = index[i / BLOCK];
+                units = entry.units;
+                position = entry.offset + (words[entry.offset] == ESCAPE ? 4 : 1);
+            }
+            if(i >= from){
+                f(i, units * UNIT);
+            }
+        }
+    }
+
+    // Last step that started at or before 'ns' nanoseconds since the first step
+    size_t step_at(uint64_t ns) const {
+        uint64_t units = ns / UNIT;
+        if(length == 0 || units < index[0].units){
+            return 0;
+        }
+        size_t lo = 0, hi = index.size();    // index[lo].units <= units
+        while(hi - lo > 1){
+            size_t mid = (lo + hi) / 2;
+            if(index[mid].units <= units){
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        size_t step = lo * BLOCK;
+        each(lo * BLOCK, (lo + 1) * BLOCK, [&](size_t i, uint64_t t){
+            if(t <= ns){
+                step = i;
+            }
+        });
+        return step;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    size_t memory() const {
+        return words.memory() + index.capacity() * sizeof(IndexEntry);
+    }
+
+private:
+    struct IndexEntry {
+        uint64_t    units;      // Absolute time of the block's first step
+        size_t      offset;     // Word offset of the block's first step
+    };
+
+    Column<uint16_t>            words;
+    std::vector<IndexEntry>     index;
+    uint64_t                    origin = 0;
+    uint64_t                    last = 0;
+    size_t                      length = 0;
+};
@@ -0,0 +1,216 @@
+#include "cursor.h"
+
+static void Cursor_clear_frames(CursorObject* self){
+    for(auto& item : self->frames){
+        Py_DECREF(item.second);
+    }
+    self->frames.clear();
+}
+
+static void Cursor_prune(CursorObject* self, size_t step){
+    // Calls that returned before 'step' aren't needed until the cursor goes back
+    // before they returned, then the frames are rebuilt
+    if(self->frames.size() < self->prune_at){
+        return;
+    }
+    auto& records = self->recording->call_records;
+    for(auto it = self->frames.begin(); it != self->frames.end();){
+        auto exit = records[it->first].exit;
+        if(exit != NO_STEP && exit < step){
+            self->pruned_until = std::max(self->pruned_until, exit + 1);
+            Py_DECREF(it->second);
+            self->frames.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    self->prune_at = std::max((size_t)64, 2 * self->frames.size());
+}
+
+static void Cursor_bind(CursorObject* self, MutationLog::Reader& reader, size_t step){
+    // Apply name bindings from the reader up to 'step'
+    Mutation binding;
+    while(reader.next(binding) && binding.step <= step){
+        auto& dict = self->frames[binding.call];
+        if(dict == NULL){
+            dict = PyDict_New();
+        }
+        Recording_bind(self->replay, binding, dict, NULL);
+    }
+}
+
+static bool Cursor_unbind(CursorObject* self, MutationLog* mutations, size_t step, size_t from){
+    // Undo the name bindings in (step, from], false if some prior value wasn't saved
+    if(step < self->pruned_until){
+        return false;
+    }
+    std::vector<Mutation> undo;
+    Mutation binding;
+    auto reader = mutations->seek_bindings(step + 1);
+    while(reader.next(binding) && binding.step <= from){
+        if(!binding.prior.known){
+            return false;
+        }
+        undo.push_back(binding);
+    }
+    for(auto it = undo.rbegin(); it != undo.rend(); ++it){
+        auto frame = self->frames.find(it->call);
+        if(frame != self->frames.end()){
+            it->c = it->prior.value;
+            it->opcode = it->c ? STORE_NAME : DELETE_NAME;
+            Recording_bind(self->replay, *it, frame->second, NULL);
+        }
+    }
+
+    // Calls that hadn't started yet
+    auto& records = self->recording->call_records;
+    for(auto it = self->frames.begin(); it != self->frames.end();){
+        auto enter = records[it->first].enter;
+        if(enter != NO_STEP && enter > step){
+            Py_DECREF(it->second);
+            self->frames.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    return true;
+}
+
+static void Cursor_move(CursorObject* self, size_t step){
+    // Replay objects and name bindings to 'step', only the difference when it is in the same Milestone
+    auto recording = self->recording;
+    auto from = self->replay.step;
+    auto source = Recording_replay(recording, self->replay, step);
+    auto mutations = std::get<0>(recording->milestones[self->replay.milestone]);
+
+    if(source == FROM_CACHE){
+        auto reader = mutations->seek_bindings(from + 1);
+        Cursor_bind(self, reader, step);
+    } else if(source != UNDO_FROM_CACHE || !Cursor_unbind(self, mutations, step, from)){
+        Cursor_clear_frames(self);
+        self->pruned_until = 0;
+        auto reader = mutations->binding_reader();
+        Cursor_bind(self, reader, step);
+    }
+    Cursor_prune(self, step);
+}
+
+static PyObject* Cursor_state(CursorObject* self){
+    // Globals overwritten with the locals of the frame at the current step
+    auto recording = self->recording;
+    auto state = PyDict_New();
+    auto globals = self->frames.find(recording->global_call);
+    if(globals != self->frames.end()){
+        PyDict_Update(state, globals->second);
+    }
+    auto call = recording->calls[self->replay.step];
+    auto locals = self->frames.find(call);
+    if(call != recording->global_call && locals != self->frames.end()){
+        PyDict_Update(state, locals->second);
+    }
+    return state;
+}
+
+static void Cursor_dealloc(CursorObject* self){
+    Cursor_clear_frames(self);
+    self->frames.~FrameDicts();
+    self->replay.~ReplayState();
+    Py_DECREF(self->recording);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* Cursor_seek(CursorObject* self, PyObject* args){
+    PyObject *n_obj;
+    if (PyArg_UnpackTuple(args, "seek", 1, 1, &n_obj)) {
+        auto n = PyLong_AsLong(n_obj);
+        if(PyErr_Occurred()){
+            return NULL;
+        }
+        if(n < 0 || (size_t)n >= self->recording->lines.size()){
+            PyErr_SetString(PyExc_IndexError, "step out of range");
+            return NULL;
+        }
+        Cursor_move(self, (size_t)n);
+        return Cursor_state(self);
+    }
+    return NULL;
+}
+
+static PyObject* Cursor_step(CursorObject* self, PyObject* args){
+    if (PyArg_UnpackTuple(args, "step", 0, 0)) {
+        if(self->replay.milestone == NO_MILESTONE){
+            Py_RETURN_NONE;     // Hasn't been moved yet
+        }
+        return PyLong_FromSize_t(self->replay.step);
+    }
+    return NULL;
+}
+
+static PyObject* Cursor_iter_range(CursorObject* self, PyObject* args){
+    PyObject *start_obj, *stop_obj = NULL;
+    if (PyArg_UnpackTuple(args, "iter", 1, 2, &start_obj, &stop_obj)) {
+        auto start = PyLong_AsLong(start_obj);
+        auto stop = stop_obj == NULL || stop_obj == Py_None ? (long)self->recording->lines.size() : PyLong_AsLong(stop_obj);
+        if(PyErr_Occurred()){
+            return NULL;
+        }
+        self->iter_next = start > 0 ? start : 0;
+        self->iter_stop = stop > 0 ? stop : 0;
+        Py_INCREF(self);
+        return (PyObject*)self;
+    }
+    return NULL;
+}
+
+static PyObject* Cursor_iter(CursorObject* self){
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject* Cursor_iternext(CursorObject* self){
+    auto stop = std::min(self->iter_stop, self->recording->lines.size());
+    if(self->iter_next >= stop){
+        return NULL;    // StopIteration
+    }
+    Cursor_move(self, self->iter_next++);
+    return Cursor_state(self);
+}
+
+static PyMethodDef Cursor_methods[] = {
+    {"seek", (PyCFunction) Cursor_seek, METH_VARARGS, "Move to step n and get the state dict there"},
+    {"step", (PyCFunction) Cursor_step, METH_VARARGS, "Get the step the cursor is on, or None before the first seek"},
+    {"iter", (PyCFunction) Cursor_iter_range, METH_VARARGS, "Iterate the state dict of each step in [start, stop)"},
+    {NULL}
+};
+
+static PyTypeObject CursorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "execorder.Cursor",
+    sizeof(CursorObject),
+    0,
+    (destructor) Cursor_dealloc,                /* tp_dealloc */
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    "Replay position in a recording. The objects in its states are replayed in place as it moves, copy them to keep them", /* tp_doc */
+    0, 0, 0, 0,
+    (getiterfunc) Cursor_iter,                  /* tp_iter */
+    (iternextfunc) Cursor_iternext,             /* tp_iternext */
+    Cursor_methods,                             /* tp_methods */
+};
+
+PyTypeObject* Cursor_Type(){
+    return &CursorType;
+}
+
+PyObject* Cursor_New(RecordingObject* recording){
+    auto self = PyObject_New(CursorObject, &CursorType);
+    new (&self->replay) ReplayState();
+    new (&self->frames) FrameDicts();
+    Py_INCREF(recording);
+    self->recording = recording;
+    self->prune_at = 64;
+    self->pruned_until = 0;
+    self->iter_next = 0;
+    self->iter_stop = 0;
+    return (PyObject*)self;
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include "Python.h"
+#include "recording.h"
+
+using FrameDicts = phmap::flat_hash_map<CallId, PyObject*>;
+
+// ==== class Cursor ====================
+// A replay position in a recording that moves cheaply to nearby steps
+typedef struct {
+    PyObject_HEAD
+    RecordingObject*        recording;
+    ReplayState             replay;         // Own copies of the objects, other queries don't move them
+    FrameDicts              frames;         // Names bound by each call instance, as of replay.step
+    size_t                  prune_at;       // Forget ended calls once frames gets this big
+    size_t                  pruned_until;   // Frames are missing calls that were live before this step
+    size_t                  iter_next;
+    size_t                  iter_stop;
+} CursorObject;
+
+PyObject* Cursor_New(RecordingObject* recording);
+PyTypeObject* Cursor_Type(void);
@@ -0,0 +1,61 @@
+import copy
+import execorder
+
+code = '''
+def f(n):
+    L = [n]
+    for i in range(n):
+        L[0] = L[0] + i
+        M = (L, i)
+    return L
+
+X = [[1, 2], {'a': (1, [2])}, {3, 4}]
+X[1]['a'][1][0] = 5
+Y = X[0]
+Y[0] = -1
+C = [0]
+C[0] = C
+for k in range(4):
+    X[0][1] = f(k)
+    X[1]['b'] = (k, X[0])
+'''
+
+recording = execorder.exec(code)
+N = recording.steps()
+
+# States computed the plain way, each from a recording of its own replayed forwards
+reference = execorder.exec(code)
+reference.cache_bytes = 0
+expected = [copy.deepcopy(reference.state(n)) for n in range(N)]
+
+def same(state, n):
+    state = {k: v for k, v in state.items() if k != '__builtins__' and not callable(v)}
+    want = {k: v for k, v in expected[n].items() if k != '__builtins__' and not callable(v)}
+    assert repr(state) == repr(want), (n, state, want)
+
+# A cursor's states are its replayed objects, updated as it moves
+cursor = recording.cursor()
+for n, state in zip(range(N), cursor.iter(0, N)):
+    same(state, n)
+for n in list(range(0, N, 7)) + list(range(N - 1, -1, -5)) + [3, N - 1, 0]:
+    same(cursor.seek(n), n)
+for n, state in zip(range(N // 2, N), cursor.iter(N // 2)):
+    same(state, n)
+
+# Queries clone them instead: kept states don't change, and share objects like the program did
+states = [recording.state(n) for n in range(N)]
+for n in range(N - 1, -1, -1):
+    same(states[n], n)
+    same(recording.state(n), n)
+s = states[-1]
+assert s['Y'] is s['X'][0] and s['X'][1]['b'][1] is s['X'][0] and s['C'][0] is s['C']
+s['X'][0].append(1)
+assert recording.state(N - 1)['X'][0] is not s['X'][0] and len(recording.state(N - 1)['X'][0]) == 2
+for n in range(N):
+    # The innermost frame's locals over the module's are the state
+    stack = recording.stack(n)
+    merged = dict(stack[0]['locals'])
+    merged.update(stack[-1]['locals'])
+    same(merged, n)
+
+print('OK')
@@ -0,0 +1,53 @@
+import execorder
+
+code = '''
+Y = [[1, 2], [3, 4]]
+D = {'a': [1], 'b': [2]}
+A = D['a']
+Z = []
+a = 0
+Y[0][0] = 5
+a = 1
+D['b'][0] = 3
+a = 2
+D['a'][0] = 7
+a = 3
+Z += [[0]]
+a = 4
+Z[0][0] = 9
+a = 5
+'''
+
+recording = execorder.exec(code)
+lines = code.split('\n')
+
+def changed_by(line):
+    # diff() across the step that ran 'line'
+    n = next(n for n in range(recording.steps()) if lines[recording.line(n) - 1] == line)
+    return recording.diff(n, n + 1)
+
+before, after = changed_by('Y[0][0] = 5')
+assert set(before) == {'Y'} and set(after) == {'Y'}, (before, after)
+assert before['Y'] == [[1, 2], [3, 4]] and after['Y'] == [[5, 2], [3, 4]], (before, after)
+
+before, after = changed_by("D['b'][0] = 3")
+assert set(after) == {'D'}, after                   # A is D['a'], which didn't change
+assert before['D']['b'] == [2] and after['D']['b'] == [3]
+
+before, after = changed_by("D['a'][0] = 7")
+assert set(after) == {'D', 'A'}, after
+assert before['A'] == [1] and after['A'] == [7]
+
+before, after = changed_by('Z[0][0] = 9')          # Z[0] was stored into Z after the snapshot
+assert set(after) == {'Z'}, after
+assert before['Z'] == [[0]] and after['Z'] == [[9]]
+
+# Every name whose value differs between two steps is in their diff
+for n in range(recording.steps() - 1):
+    s1, s2 = recording.state(n), recording.state(n + 1)
+    before, after = recording.diff(n, n + 1)
+    for name in (set(s1) | set(s2)) - {'__builtins__'}:
+        if s1.get(name) != s2.get(name) or (name in s1) != (name in s2):
+            assert name in before or name in after, (n, name)
+
+print('OK')
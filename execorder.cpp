@@ -8,6 +8,9 @@
 #include "frameobject.h"
 #include "opcode.h"
 #include "recording.h"
+#include "visits.h"
+#include "cursor.h"
+#include "state_mapping.h"
 #include <atomic>
 
 #define TOP()       (frame->f_stacktop[-1])
@@ -25,12 +28,26 @@ bool get_recording(PyFrameObject* frame, RecordingObject** recording){
     return in_my_code != NULL;
 }
 
-void mutation(PyFrameObject* frame, int opcode, int i, PyObject* a, PyObject* b, PyObject* c){
+int trace_step(PyFrameObject *frame, RecordingObject* recording, int what);
+
+int mutation(PyFrameObject* frame, int opcode, int i, PyObject* a, PyObject* b, PyObject* c){
     // A mutation occurred, see whether we need to record it...
     RecordingObject* recording = NULL;
     bool in_my_code = get_recording(frame, &recording);
     auto f = (PyObject*)frame;
 
+    if(in_my_code && recording->opcode_granularity){
+        // Mutating instruction in my code gets a step of its own
+        int err = trace_step(frame, recording, PyTrace_OPCODE);
+        if(err){
+            return err;
+        }
+    }
+
+    if(recording == NULL || !recording->record_state){
+        return 0;
+    }
+
     if(in_my_code){
         PyObject *name = NULL;
         switch(opcode){
@@ -83,44 +100,46 @@ void mutation(PyFrameObject* frame, int opcode, int i, PyObject* a, PyObject* b,
                 break;
         }
     }
+    return 0;
 }
 
 int trace_opcode(PyFrameObject* frame){
     // Check whether the next opcode can potentially mutate state...
-    auto instructions = PyBytes_AS_STRING(frame->f_code->co_code);
-    auto opcode = instructions[frame->f_lasti];
-    auto oparg  = instructions[frame->f_lasti + 1];
+    auto instructions = (unsigned char*)PyBytes_AS_STRING(frame->f_code->co_code);
+    int opcode = instructions[frame->f_lasti];
+    int oparg  = Recording_oparg(frame);
     
+    int err = 0;
     switch(opcode){
         case STORE_FAST:
-            mutation(frame, STORE_FAST, oparg, NULL, NULL, TOP());
+            err = mutation(frame, STORE_FAST, oparg, NULL, NULL, TOP());
             break;
         case DELETE_FAST:
-            mutation(frame, DELETE_FAST, oparg, NULL, NULL, NULL);
+            err = mutation(frame, DELETE_FAST, oparg, NULL, NULL, NULL);
             break;
         case STORE_SUBSCR:
-            mutation(frame, STORE_SUBSCR, 0, SECOND(), TOP(), THIRD());
+            err = mutation(frame, STORE_SUBSCR, 0, SECOND(), TOP(), THIRD());
             break;
         case DELETE_SUBSCR:
-            mutation(frame, DELETE_SUBSCR, 0, SECOND(), TOP(), NULL);
+            err = mutation(frame, DELETE_SUBSCR, 0, SECOND(), TOP(), NULL);
             break;
         case STORE_NAME:
-            mutation(frame, STORE_NAME, 0, frame->f_locals, NAME(), TOP());
+            err = mutation(frame, STORE_NAME, 0, frame->f_locals, NAME(), TOP());
             break;
         case DELETE_NAME:
-            mutation(frame, STORE_NAME, 0, frame->f_locals, NAME(), NULL);
+            err = mutation(frame, DELETE_NAME, 0, frame->f_locals, NAME(), NULL);
             break;
         case STORE_ATTR:
-            mutation(frame, STORE_ATTR, 0, TOP(), NAME(), SECOND());
+            err = mutation(frame, STORE_ATTR, 0, TOP(), NAME(), SECOND());
             break;
         case DELETE_ATTR:
-            mutation(frame, DELETE_ATTR, 0, TOP(), NAME(), NULL);
+            err = mutation(frame, DELETE_ATTR, 0, TOP(), NAME(), NULL);
             break;
         case STORE_GLOBAL:
-            mutation(frame, STORE_GLOBAL, 0, NAME(), NULL, TOP());
+            err = mutation(frame, STORE_GLOBAL, 0, NAME(), NULL, TOP());
             break;
         case DELETE_GLOBAL:
-            mutation(frame, DELETE_GLOBAL, 0, NAME(), NULL, NULL);
+            err = mutation(frame, DELETE_GLOBAL, 0, NAME(), NULL, NULL);
             break;
         case INPLACE_ADD:   // TODO: deal with unicode
         case INPLACE_POWER:
@@ -135,39 +154,42 @@ int trace_opcode(PyFrameObject* frame){
         case INPLACE_AND:
         case INPLACE_XOR:
         case INPLACE_OR:
-            mutation(frame, opcode, 0, SECOND(), TOP(), NULL);
+            err = mutation(frame, opcode, 0, SECOND(), TOP(), NULL);
             break;
     }
-    return 0;
+    return err;
+}
+
+static void record_names(RecordingObject* recording, PyFrameObject* frame, PyObject* dict, int opcode){
+    PyObject *key, *value; Py_ssize_t pos = 0;
+    while(PyDict_Next(dict, &pos, &key, &value)) {
+        Recording_record(recording, opcode, (PyObject*)frame, key, value);
+    }
 }
 
 int trace_step(PyFrameObject *frame, RecordingObject* recording, int what){
     if(recording->record_state){
-        if(recording->global_frame == NULL){
-            recording->global_frame = (PyObject*)frame;    // First trace step, save the frame
+        if(recording->global_call == NO_CALL){
+            recording->global_call = Recording_call_id(recording, frame);  // First trace step, save the frame
         }
 
         // Deal with 'hidden' name bindings when entering new frame
-        if(recording->fresh_milestone || what == PyTrace_CALL){
-            PyFrame_FastToLocals(frame);        // TODO: this is slow, refactor it out?
-
-            std::vector<PyObject*> dicts; int opcode;
-            if(recording->fresh_milestone){
-                dicts = {frame->f_globals, frame->f_locals};
-                opcode = STORE_GLOBAL;
-                recording->fresh_milestone = false;
-            } else {
-                dicts = {frame->f_locals};
-                opcode = STORE_NAME;
-            }
-
-            PyObject *key, *value; Py_ssize_t pos = 0;
-            for(auto& dict : dicts){
-                while(PyDict_Next(dict, &pos, &key, &value)) {
-                    Recording_record(recording, opcode, (PyObject*)frame, key, value);
-                    opcode = STORE_NAME;
+        if(recording->fresh_milestone){
+            // New Milestone, snapshot globals and the locals of every frame of my code still running
+            record_names(recording, frame, frame->f_globals, STORE_GLOBAL);
+            for(auto f = frame; f != NULL; f = f->f_back){
+                RecordingObject* f_recording = NULL;
+                if(get_recording(f, &f_recording) && f_recording == recording){
+                    PyFrame_FastToLocals(f);        // TODO: this is slow, refactor it out?
+                    if(f->f_locals != f->f_globals){
+                        record_names(recording, f, f->f_locals, STORE_NAME);
+                    }
                 }
             }
+            recording->fresh_milestone = false;
+        } else if(what == PyTrace_CALL){
+            PyFrame_FastToLocals(frame);
+            record_names(recording, frame, frame->f_locals, STORE_NAME);
         }
     }
 
@@ -187,11 +209,15 @@ int trace(PyObject *obj, PyFrameObject *frame, int what, PyObject *arg){
         if(recording == NULL && what == PyTrace_CALL && frame->f_back != NULL){
             // Newly called frame - copy possible Recording from parent
             _PyCode_GetExtra((PyObject*)frame->f_back->f_code, recording_i, (void**)&recording);
-            _PyCode_SetExtra((PyObject*)frame->f_code, recording_i, (void*)recording);
+            if(recording != NULL){
+                _PyCode_SetExtra((PyObject*)frame->f_code, recording_i, (void*)recording);
+                Py_INCREF(frame->f_code);
+                recording->called_code.push_back((PyObject*)frame->f_code);
+            }
         }
 
         if(recording != NULL){
-            if(recording->record_state){
+            if(recording->record_state || recording->opcode_granularity){
                 frame->f_trace_opcodes = 1;
             }
 
@@ -218,12 +244,33 @@ void mark_code_with_recording(PyObject* code, RecordingObject* recording){
     }
 }
 
+void unmark_called_code(RecordingObject* recording){
+    // Other code is only marked while the Recording runs, later Recordings calling it
+    // mark it again (and this one may be freed by then)
+    for(auto code : recording->called_code){
+        RecordingObject* marked = NULL;
+        _PyCode_GetExtra(code, recording_i, (void**)&marked);
+        if(marked == recording){
+            _PyCode_SetExtra(code, recording_i, NULL);
+        }
+        Py_DECREF(code);
+    }
+    recording->called_code.clear();
+}
+
 static PyObject* exec(PyObject *self, PyObject *args, PyObject *kwargs){
     PyObject *code_str, *globals, *callback = NULL;
-    long max_steps = 0, record_state = 1;
-    char *keywords[] = {"", "", "callback", "max_steps", "record_state", NULL};
-    if(PyArg_ParseTupleAndKeywords(args, kwargs, "O|O$Olp:exec", keywords, &code_str, &globals,
-                                                                &callback, &max_steps, &record_state)){
+    long max_steps = 0, record_state = 1, timing = 0;
+    const char *granularity = "line";
+    char *keywords[] = {"", "", "callback", "max_steps", "record_state", "granularity", "timing", NULL};
+    if(PyArg_ParseTupleAndKeywords(args, kwargs, "O|O$Olpsp:exec", keywords, &code_str, &globals,
+                                                &callback, &max_steps, &record_state, &granularity, &timing)){
+        bool opcode_granularity = strcmp(granularity, "opcode") == 0;
+        if(!opcode_granularity && strcmp(granularity, "line") != 0){
+            PyErr_Format(PyExc_ValueError, "granularity must be 'line' or 'opcode', not '%s'", granularity);
+            return NULL;
+        }
+
         auto code_utf8 = PyUnicode_AsUTF8(code_str);
         auto code = Py_CompileStringExFlags(code_utf8, "<execorder>", Py_file_input, NULL, -1);
         if(PyErr_Occurred()){
@@ -232,6 +279,8 @@ static PyObject* exec(PyObject *self, PyObject *args, PyObject *kwargs){
 
         auto recording = Recording_New(code);
         recording->record_state = (bool)record_state;
+        recording->opcode_granularity = opcode_granularity;
+        recording->timing = (bool)timing;
         recording->callback = callback;
         recording->max_steps = max_steps;
 
@@ -244,9 +293,12 @@ static PyObject* exec(PyObject *self, PyObject *args, PyObject *kwargs){
         Py_DECREF(builtins);
 
         running_execs++;
+        recording->running = true;
         PyEval_SetTrace((Py_tracefunc)trace, NULL);     // Turn on tracing
         Recording_make_callback(recording);             // Starting callback 
         PyEval_EvalCode(code, globals, NULL);           // Run the code
+        recording->running = false;
+        unmark_called_code(recording);
         running_execs--;
 
         if(running_execs == 0){
@@ -291,6 +343,18 @@ PyObject* PyInit_execorder(void) {
     PyType_Ready(recording_type);
     Py_INCREF(recording_type);
     PyModule_AddObject(module, "Recording", (PyObject*)recording_type);
+    PyType_Ready(VisitsView_Type());
+    PyType_Ready(Cursor_Type());
+    PyType_Ready(StateMapping_Type());
+
+    // So isinstance(state, Mapping) holds for lazy states too
+    auto abc = PyImport_ImportModule("collections.abc");
+    auto mapping = abc ? PyObject_GetAttrString(abc, "Mapping") : NULL;
+    auto registered = mapping ? PyObject_CallMethod(mapping, "register", "O", StateMapping_Type()) : NULL;
+    if(registered == NULL){
+        PyErr_Clear();
+    }
+    Py_XDECREF(registered); Py_XDECREF(mapping); Py_XDECREF(abc);
 
     return module;
 }
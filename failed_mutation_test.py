@@ -0,0 +1,48 @@
+import io
+import sys
+import execorder
+
+# Mutations that raise in the program are recorded, and raise again when replayed
+code = '''
+X = [1, 2]
+D = {'a': 1}
+class Frozen:
+    __slots__ = ()
+F = Frozen()
+for i in range(3):
+    try:
+        X[5] = i
+    except IndexError:
+        pass
+    try:
+        del D['b']
+    except KeyError:
+        pass
+    try:
+        F.x = i
+    except AttributeError:
+        pass
+    X[0] = i
+    D['a'] = i
+'''
+
+stderr = sys.stderr
+sys.stderr = io.StringIO()
+try:
+    recording = execorder.exec(code)
+    N = recording.steps()
+    states = [recording.state(n) for n in range(N)]
+    recording.states(range(N))
+    for n in range(N - 1, -1, -1):
+        recording.cursor().seek(n)
+    printed = sys.stderr.getvalue()
+finally:
+    sys.stderr = stderr
+
+# Nothing printed, and the failed mutations are skipped: the copies keep their values
+assert printed == '', printed
+assert states[-1]['X'] == [2, 2] and states[-1]['D'] == {'a': 2}
+for n, state in enumerate(states):
+    assert len(state.get('X', [1, 2])) == 2 and list(state.get('D', ['a'])) == ['a'], (n, state)
+
+print('OK')
@@ -0,0 +1,51 @@
+import random
+import execorder
+
+# Every store writes a new value, so a change is a step where the value differs
+code = '''
+X = [0] * 8
+D = {'a': [0], 'b': 0}
+for k in range(1, 2000):
+    X[k % 8] = k
+    if k % 7 == 0:
+        D['a'][0] = k
+    if k % 11 == 0:
+        D['b'] = k
+    if k == 1500:
+        X = [-1] * 8
+'''
+
+recording = execorder.exec(code)
+N = recording.steps()
+
+# States computed the plain way
+reference = execorder.exec(code)
+reference.cache_bytes = 0
+states = reference.states(list(range(N)))
+
+def value(state, target):
+    try:
+        return repr(eval(target, {}, dict(state)))
+    except Exception:
+        return None
+
+rnd = random.Random(1)
+for target in ('X', 'X[3]', "D['a'][0]", "D['b']", 'D'):
+    values = [value(state, target) for state in states]
+    changes = [n for n in range(1, N) if values[n] != values[n - 1]]
+    for n in [rnd.randrange(N) for _ in range(40)] + [0, N - 1]:
+        after = next((c for c in changes if c > n), None)
+        before = next((c for c in reversed(changes) if c < n), None)
+        assert recording.find_change(target, after=n) == after, (target, n, after)
+        assert recording.find_change(target, before=n) == before, (target, n, before)
+
+# find() gives the first step where a predicate that stays true starts holding
+for limit in (5, 700, 1800, 1999, 5000):
+    holds = lambda state: state.get('k', 0) >= limit
+    first = next((n for n in range(N) if holds(states[n])), None)
+    assert recording.find(0, N, holds) == first, (limit, first)
+    if first is not None and first > 10:
+        assert recording.find(first - 10, first + 10, holds) == first
+        assert recording.find(0, first, holds) is None
+
+print('OK')
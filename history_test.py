@@ -0,0 +1,64 @@
+import execorder
+
+code = '''
+class P:
+    pass
+
+X = [[0, 0], [1, 1]]
+D = {'a': [1], 'b': {'c': [2]}}
+p = P()
+p.v = [X[1]]
+for i in range(3):
+    X[0][0] = i
+    D['b']['c'][0] += i
+X[1][1] = 7
+row = X[0]
+row[1] = 8
+X = X[1]
+X[0] = 9
+D['a'] = [3]
+D['a'][0] = 4
+del row
+'''
+
+recording = execorder.exec(code)
+N = recording.steps()
+states = [recording.state(n) for n in range(N)]
+
+def shown(value):
+    # Each state has its own copy of p, so compare what it holds
+    return repr(vars(value) if hasattr(value, '__dict__') else value)
+
+for name in ('X', 'D', 'p', 'row', 'i'):
+    history = recording.history(name)
+    series = recording.series(name)
+
+    # Every step where the name's value changed is in its history
+    for n in range(1, N):
+        before, after = states[n - 1].get(name, None), states[n].get(name, None)
+        if type(before) != type(after) or shown(before) != shown(after):
+            assert n in history, (name, n, before, after, history)
+
+    # Every step of the history changed the name according to diff()
+    for n in history:
+        before, after = recording.diff(n - 1, n)
+        assert name in before or name in after, (name, n, history)
+
+    # series() has the value of each change, as state() has it
+    assert [n for n, _ in series] == history, (name, series, history)
+    for n, value in series:
+        expected = states[n].get(name, None)
+        assert shown(value) == shown(expected), (name, n, value, expected)
+
+# The nested store is a change of X, but not of D
+lines = code.split('\n')
+nested = [n for n in range(1, N) if lines[recording.line(n - 1) - 1].strip() == 'X[0][0] = i']
+assert nested and all(n in recording.history('X') for n in nested)
+assert not any(n in recording.history('D') for n in nested)
+
+# p holds X[1] inside a list, so storing into X[1] changes it too
+store = next(n for n in range(1, N) if lines[recording.line(n - 1) - 1] == 'X[1][1] = 7')
+assert store in recording.history('p')
+assert recording.find_change('X', after=store - 1) == store
+
+print('OK')
@@ -0,0 +1,35 @@
+import execorder
+
+code = '''
+X = [1, 2]
+Z = X
+W = [X, X]
+D = {'x': X}
+a = 0
+'''
+
+recording = execorder.exec(code)
+n = recording.steps() - 1
+
+def check_aliases():
+    # Names of a lazy state share objects like the eager state, whichever is read first
+    for order in (['X', 'Z', 'W', 'D'], ['W', 'D', 'Z', 'X'], ['D', 'W', 'X', 'Z']):
+        l = recording.state(n, lazy=True)
+        for name in order:
+            l[name]
+        assert l['X'] is l['Z'], order
+        assert l['W'][0] is l['X'] and l['W'][1] is l['X'], order
+        assert l['D']['x'] is l['X'], order
+        l['X'].append(3)
+        assert l['W'] == [[1, 2, 3], [1, 2, 3]], order
+
+check_aliases()                 # Partial replays, the milestone isn't replayed yet
+s = recording.state(n)
+assert s['X'] is s['Z'] and s['W'][0] is s['X'] and s['D']['x'] is s['X']
+check_aliases()                 # From the replayed milestone
+
+# Separate states don't share objects
+l1, l2 = recording.state(n, lazy=True), recording.state(n, lazy=True)
+assert l1['X'] is not l2['X'] and l1['X'] == l2['X']
+
+print('OK')
@@ -0,0 +1,26 @@
+import gc
+import random
+import execorder
+
+code = '''
+import random
+
+random.seed(123)
+X = list(range(50))
+random.shuffle(X)
+done = True
+'''
+
+# Code outside the recording (random.shuffle) mutates X, each recording must see that
+random.seed(123)
+expected = list(range(50))
+random.shuffle(expected)
+
+for n in range(5):
+    recording = execorder.exec(code)
+    X = recording.state(recording.steps() - 1)['X']
+    assert X == expected, (n, X[:10], expected[:10])
+    del recording       # The next recording calls shuffle after this one is freed
+    gc.collect()
+
+print('OK')
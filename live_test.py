@@ -0,0 +1,64 @@
+import sys
+import random
+import threading
+import execorder
+
+code = '''
+class P:
+    pass
+
+p = P()
+X = [0] * 20
+D = {}
+for i in range(60000):
+    X[i % 20] = i
+    D[i % 7] = [i, X[(i + 1) % 20]]
+    p.a = i
+'''
+
+def shown(state):
+    return repr(sorted((name, vars(value) if name == 'p' else value)
+                       for name, value in state.items() if name in ('p', 'X', 'D', 'i')))
+
+# Queries made by a thread started from the callback, while the code is running
+got, errors, running, done = [], [], [], []
+
+def reader(recording):
+    rnd = random.Random(1)
+    cursor = recording.cursor()
+    while not done:
+        k = recording.steps()
+        try:
+            for n in (k - 1, rnd.randrange(k)):
+                got.append(('state', n, shown(recording.state(n))))
+            n = rnd.randrange(k)
+            got.append(('names', n, shown(recording.state(n, names=['X', 'p']))))
+            n = rnd.randrange(k)
+            got.append(('cursor', n, shown(cursor.seek(n))))
+            running.append(recording.running)
+        except Exception as e:
+            errors.append(repr(e))
+
+threads = []
+def callback(recording):
+    if not threads and recording.steps() > 0:
+        threads.append(threading.Thread(target=reader, args=(recording,)))
+        threads[0].start()
+
+sys.setswitchinterval(1e-5)
+recording = execorder.exec(code, callback=callback)
+done.append(True)
+threads[0].join()
+assert not recording.running
+assert not errors, errors[:3]
+assert got and any(running), (len(got), any(running))
+
+# Each of them matches the state computed the plain way once the code finished
+reference = execorder.exec(code)
+reference.cache_bytes = 0
+for kind, n, value in got:
+    names = ['X', 'p'] if kind == 'names' else None
+    expected = shown(reference.state(n, names=names))
+    assert value == expected, (kind, n, value[:200], expected[:200])
+
+print('OK')
@@ -0,0 +1,639 @@
+#pragma once
+#include "Python.h"
+#include "opcode.h"
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include "parallel_hashmap/phmap.h"
+
+using CallId = uint32_t;                    // One call instance, i.e. a frame for as long as it lives
+const CallId NO_CALL = 0xFFFFFFFF;
+
+inline bool is_name_binding(int opcode){
+    switch(opcode){
+        case STORE_NAME:    case DELETE_NAME:
+        case STORE_FAST:    case DELETE_FAST:
+        case STORE_GLOBAL:  case DELETE_GLOBAL:
+            return true;
+    }
+    return false;
+}
+
+// What a mutation overwrote, so that it can be undone
+struct Prior {
+    bool            known;      // False when it couldn't be saved, the mutation can't be undone
+    PyObject*       value;      // NULL when there was nothing there (e.g. a new dict key)
+};
+
+// How an object mutation may be folded into a skip table
+enum SkipKind : unsigned char {
+    SKIP_KEYED,         // Only the last write of each key counts (dict items, attributes, list items)
+    SKIP_ORDERED,       // All of the object's mutations are kept in order (in place operations...)
+    SKIP_READS,         // Also reads object b, so b's own mutations can't be moved past it
+};
+
+// A decoded mutation record
+struct Mutation {
+    size_t          step;       // Step the mutation is visible from
+    unsigned char   opcode;
+    CallId          call;       // Binding frame, for name bindings
+    PyObject*       a;
+    PyObject*       b;          // NULL when the key is the inline small int 'index'
+    PyObject*       c;
+    Py_ssize_t      index;
+    Prior           prior;
+    size_t          ref_a;      // Indexes of a, b and c in the log's object table, 0 for NULL
+    size_t          ref_b;
+    size_t          ref_c;
+};
+
+/*
+    The mutations recorded during one Milestone, encoded as two byte streams:
+    name bindings, and mutations of objects. Keeping them apart means
+    replaying objects never has to step over the (usually far more numerous)
+    bindings, and bindings never have to step over object mutations.
+
+    Each record is
+        varint      step, as a delta from the previous record in its stream
+        byte        opcode, high bit set when the key is an inline small int
+        varint      CallId of the binding frame (name bindings) or object a
+        varint      object b, or the key itself when it is inline
+        varint      object c
+        varint      prior value: 0 nothing, 1 unknown, else object index + 1
+    Objects are stored as indices into the log's object table, 0 being NULL.
+
+    Every CHECKPOINT records of a stream the byte offset and previous step
+    are saved so that a Reader can start part way through it. The position
+    of every name binding is also indexed by its CallId and by its name, so
+    the variables of one frame or the history of one name cost only as much
+    as the records that concern them. The recorder doesn't build these
+    indexes: the first query that needs them does (index_bindings()), and
+    later ones catch them up with whatever was recorded since.
+
+    Every SKIP object mutations the recorder also writes a skip table: the
+    same records for that interval with only the last write of each key of
+    each object kept, in an order that leaves dicts in the same key order.
+    A SkipReader applies it in place of the interval when the whole interval
+    is wanted, so replay work grows with what was written rather than how
+    often. Objects with in place operations or other order-dependent
+    mutations keep all their records, and intervals where a mutation reads
+    another object that is mutated in the same interval (e.g. a += b, then
+    b[0] = 1) or that barely shrink get no table.
+    In the same way, the index saves the latest binding of each name of a
+    call instance every NAME_SKIP bindings it made, so resolving a frame's
+    names only decodes the bindings since the last such table.
+*/
+
+// ==== class MutationLog ====================
+class MutationLog {
+public:
+    static const size_t CHECKPOINT = 64;
+    static const size_t SKIP = 4096;            // A multiple of CHECKPOINT
+    static const size_t NAME_SKIP = 1024;
+    static const Py_ssize_t MAX_INLINE = 0x0FFFFFFF;
+
+    struct Checkpoint {
+        size_t      offset;     // Byte offset of the record
+        size_t      step;       // Step of the record before it (the delta base)
+    };
+
+    struct Binding {
+        size_t      step;       // Step the binding is visible from
+        size_t      offset;     // Byte offset of the record in the bindings stream
+    };
+    using Bindings = std::vector<Binding>;
+    using BoundNames = std::vector<std::pair<PyObject*, size_t>>;  // (name, index in bindings_of(call)), in dict order
+
+    struct Stream {
+        std::vector<unsigned char>  bytes;
+        std::vector<Checkpoint>     checkpoints;
+        size_t                      count = 0;
+        size_t                      last_step = 0;
+    };
+
+    MutationLog(){
+        object_stream.bytes.reserve(1 << 16);
+        binding_stream.bytes.reserve(1 << 18);
+        table.push_back(NULL);
+    }
+
+    void append(size_t step, unsigned char opcode, CallId call, PyObject* a, PyObject* b, PyObject* c, Prior prior,
+                SkipKind kind = SKIP_ORDERED){
+        if(size() == 0){
+            start_step = step;
+        }
+        bool binding = is_name_binding(opcode);
+        auto& stream = binding ? binding_stream : object_stream;
+        if(stream.count % CHECKPOINT == 0){
+            stream.checkpoints.push_back({stream.bytes.size(), stream.last_step});
+        }
+
+        write(stream, step - stream.last_step);
+        stream.last_step = step;
+
+        int overflow = 0;
+        Py_ssize_t key = -1;
+        if((opcode == STORE_SUBSCR || opcode == DELETE_SUBSCR) && PyLong_CheckExact(b)){
+            key = PyLong_AsLongAndOverflow(b, &overflow);
+        }
+        bool inline_key = overflow == 0 && 0 <= key && key <= MAX_INLINE;
+        stream.bytes.push_back(inline_key ? opcode | 0x80 : opcode);
+
+        write(stream, binding ? call : intern(a));
+        write(stream, inline_key ? (size_t)key : intern(b));
+        write(stream, intern(c));
+        write(stream, !prior.known ? 1 : prior.value == NULL ? 0 : intern(prior.value) + 1);
+        stream.count++;
+
+        if(!binding){
+            interval_kinds.push_back(kind);
+            if(stream.count % SKIP == 0){
+                build_skip();
+                interval_kinds.clear();
+            }
+        }
+    }
+
+    // ==== class MutationLog::Reader ====================
+    class Reader {
+    public:
+        Reader(const MutationLog* log, const Stream* stream, size_t position, size_t step, size_t record)
+            : log(log), stream(stream), position(position), step(step), record(record) {}
+
+        Reader(const MutationLog* log, const Stream* stream, size_t checkpoint) : log(log), stream(stream) {
+            if(checkpoint < stream->checkpoints.size()){
+                auto& from = stream->checkpoints[checkpoint];
+                position = from.offset;
+                step = from.step;
+                record = checkpoint * CHECKPOINT;
+            } else {
+                position = stream->bytes.size();
+                step = stream->last_step;
+                record = stream->count;
+            }
+        }
+
+        bool next(Mutation& m){
+            if(record >= stream->count){
+                return false;
+            }
+            step += read();
+            m.step = step;
+            unsigned char op = stream->bytes[position++];
+            m.opcode = op & 0x7F;
+
+            size_t a = read(), b = read(), c = read();
+            if(is_name_binding(m.opcode)){
+                m.call = (CallId)a;
+                a = 0;
+            } else {
+                m.call = NO_CALL;
+            }
+            if(op & 0x80){
+                m.index = (Py_ssize_t)b;
+                b = 0;
+            } else {
+                m.index = -1;
+            }
+            m.ref_a = a; m.ref_b = b; m.ref_c = c;
+            m.a = log->table[a];
+            m.b = log->table[b];
+            m.c = log->table[c];
+            size_t prior = read();
+            m.prior.known = prior != 1;
+            m.prior.value = prior < 2 ? NULL : log->table[prior - 1];
+            record++;
+            return true;
+        }
+
+        size_t index() const {
+            return record;      // Number of records read so far
+        }
+
+        size_t offset() const {
+            return position;    // Byte offset of the next record
+        }
+
+    private:
+        size_t read(){
+            size_t value = 0; unsigned shift = 0; unsigned char byte;
+            do {
+                byte = stream->bytes[position++];
+                value |= (size_t)(byte & 0x7F) << shift;
+                shift += 7;
+            } while(byte & 0x80);
+            return value;
+        }
+
+        const MutationLog* log;
+        const Stream* stream;
+        size_t position, step, record;
+    };
+
+    // ==== class MutationLog::SkipReader ====================
+    // Reader over the object mutations that reads the skip table of each whole interval up to 'until' instead
+    class SkipReader {
+    public:
+        SkipReader(const MutationLog* log, Reader reader)
+            : log(log), reader(reader), summary(log, NULL, 0, 0, 0) {}
+
+        bool next(Mutation& m, size_t until){
+            while(true){
+                if(in_summary){
+                    if(summary.next(m)){
+                        return true;
+                    }
+                    in_summary = false;
+                    reader = Reader(log, &log->object_stream, resume);
+                }
+                auto record = reader.index();
+                if(record % SKIP == 0 && record / SKIP < log->skips.size()){
+                    auto& skip = log->skips[record / SKIP];
+                    if(skip && skip->last_step <= until){
+                        summary = Reader(log, skip.get(), 0, 0, 0);
+                        resume = (record + SKIP) / CHECKPOINT;
+                        in_summary = true;
+                        continue;
+                    }
+                }
+                return reader.next(m);
+            }
+        }
+
+    private:
+        const MutationLog* log;
+        Reader reader;
+        Reader summary;
+        size_t resume = 0;      // Checkpoint after the interval being read from its table
+        bool in_summary = false;
+    };
+
+    // Object of the log's object table, as referenced by Mutation::ref_a etc.
+    PyObject* object(size_t ref) const {
+        return table[ref];
+    }
+
+    size_t objects() const {
+        return table.size();
+    }
+
+    // Reader over the object mutations
+    Reader reader() const {
+        return Reader(this, &object_stream, 0);
+    }
+
+    // Reader over the name bindings of every frame, in order
+    Reader binding_reader() const {
+        return Reader(this, &binding_stream, 0);
+    }
+
+    // Reader positioned on the first object mutation visible at 'step' or later
+    Reader seek(size_t step) const {
+        return seek(object_stream, step);
+    }
+
+    // Reader over the object mutations that skips whole intervals where it can
+    SkipReader skip_reader() const {
+        return SkipReader(this, reader());
+    }
+
+    // SkipReader positioned on the first object mutation visible at 'step' or later
+    SkipReader skip_seek(size_t step) const {
+        return SkipReader(this, seek(step));
+    }
+
+    // Reader positioned on the first name binding visible at 'step' or later
+    Reader seek_bindings(size_t step) const {
+        return seek(binding_stream, step);
+    }
+
+    // Positions of the name bindings made by a call instance, in step order, as of index_bindings()
+    const Bindings* bindings_of(CallId call) const {
+        auto it = bindings.find(call);
+        return it == bindings.end() ? NULL : &it->second;
+    }
+
+    // Positions of the bindings of a name by any call instance, in step order, as of index_bindings()
+    const Bindings* bindings_named(PyObject* name) const {
+        auto it = names.find(name);
+        return it == names.end() ? NULL : &it->second;
+    }
+
+    // Whether the bindings are indexed up to the last one recorded
+    bool bindings_indexed() const {
+        return indexed_count == binding_stream.count;
+    }
+
+    // Index the bindings recorded since the last call by call instance and by name
+    void index_bindings(){
+        Reader reader(this, &binding_stream, indexed.offset, indexed.step, indexed_count);
+        Mutation m;
+        size_t offset = reader.offset();
+        while(reader.next(m)){
+            auto& calls = bindings[m.call];
+            calls.push_back({m.step, offset});
+            names[m.b].push_back({m.step, offset});
+            if(calls.size() % NAME_SKIP == 0){
+                NameTable saved;
+                saved.count = calls.size();
+                names_until(m.call, calls.size(), saved.names);
+                name_tables[m.call].push_back(std::move(saved));
+            }
+            indexed = {reader.offset(), m.step};
+            offset = reader.offset();
+        }
+        indexed_count = reader.index();
+    }
+
+    // The names a call instance had bound at 'step', each with its last binding
+    void names_at(CallId call, size_t step, BoundNames& names) const {
+        auto calls = bindings_of(call);
+        if(calls != NULL){
+            auto end = std::upper_bound(calls->begin(), calls->end(), step, [](size_t step, const Binding& binding){
+                return step < binding.step;
+            });
+            names_until(call, end - calls->begin(), names);
+        }
+    }
+
+    void decode(const Binding& binding, Mutation& m) const {
+        Reader(this, &binding_stream, binding.offset, 0, 0).next(m);
+        m.step = binding.step;
+    }
+
+    // Number of object mutations visible at 'step'
+    size_t count_until(size_t step) const {
+        return seek(step + 1).index();
+    }
+
+    size_t size() const {
+        return object_stream.count + binding_stream.count;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    size_t first_step() const {
+        return start_step;
+    }
+
+    size_t memory() const {
+        size_t bindings_memory = bindings.capacity() * (sizeof(CallId) + sizeof(Bindings) + 1)
+                               + names.capacity() * (sizeof(PyObject*) + sizeof(Bindings) + 1);
+        for(auto& item : bindings){
+            bindings_memory += item.second.capacity() * sizeof(Binding);
+        }
+        for(auto& item : names){
+            bindings_memory += item.second.capacity() * sizeof(Binding);
+        }
+        for(auto& item : name_tables){
+            for(auto& table : item.second){
+                bindings_memory += sizeof(NameTable) + table.names.capacity() * sizeof(BoundNames::value_type);
+            }
+        }
+        for(auto& skip : skips){
+            bindings_memory += sizeof(skip) + (skip ? sizeof(Stream) + stream_memory(*skip) : 0);
+        }
+        return stream_memory(object_stream) + stream_memory(binding_stream)
+             + table.capacity() * sizeof(PyObject*)
+             + table_index.capacity() * (sizeof(PyObject*) + sizeof(size_t) + 1)
+             + bindings_memory;
+    }
+
+private:
+    struct NameTable {
+        size_t      count;      // Bindings of the call it covers
+        BoundNames  names;
+    };
+
+    void names_until(CallId call, size_t count, BoundNames& names) const {
+        // The names bound by the first 'count' bindings of a call, starting from the last table within them
+        names.clear();
+        auto calls = bindings_of(call);
+        size_t from = 0;
+        auto tables = name_tables.find(call);
+        if(tables != name_tables.end()){
+            for(auto it = tables->second.rbegin(); it != tables->second.rend(); ++it){
+                if(it->count <= count){
+                    names = it->names;
+                    from = it->count;
+                    break;
+                }
+            }
+        }
+        // Deleted names are dropped, a name bound again goes to the end like in a dict
+        phmap::flat_hash_map<PyObject*, size_t> at;
+        for(size_t i = 0; i < names.size(); i++){
+            at[names[i].first] = i;
+        }
+        const size_t DELETED = (size_t)-1;
+        Mutation m;
+        for(size_t i = from; i < count; i++){
+            decode((*calls)[i], m);
+            auto it = at.find(m.b);
+            if(m.opcode == STORE_FAST || m.opcode == STORE_NAME || m.opcode == STORE_GLOBAL){
+                if(it != at.end()){
+                    names[it->second].second = i;
+                } else {
+                    at[m.b] = names.size();
+                    names.push_back({m.b, i});
+                }
+            } else if(it != at.end()){
+                names[it->second].second = DELETED;
+                at.erase(it);
+            }
+        }
+        names.erase(std::remove_if(names.begin(), names.end(), [DELETED](const BoundNames::value_type& name){
+            return name.second == DELETED;
+        }), names.end());
+    }
+
+    void build_skip(){
+        // Fold the interval of object mutations that just filled up into its skip table
+        auto interval = object_stream.count / SKIP - 1;
+        skips.resize(interval + 1);
+        std::vector<Mutation> records(SKIP);
+        Reader reader(this, &object_stream, interval * SKIP / CHECKPOINT);
+        phmap::flat_hash_set<PyObject*> targets;
+        for(size_t i = 0; i < SKIP; i++){
+            reader.next(records[i]);
+            targets.insert(records[i].a);
+        }
+        for(size_t i = 0; i < SKIP; i++){
+            if(interval_kinds[i] == SKIP_READS && targets.count(records[i].b)){
+                return;     // Reads an object mutated in the same interval
+            }
+        }
+
+        // Mutations of different objects can be reordered, so fold each object on its own
+        struct Writes {
+            std::vector<size_t>     records;
+            bool                    ordered = false;
+        };
+        phmap::flat_hash_map<PyObject*, size_t> object_at;
+        std::vector<Writes> objects;
+        for(size_t i = 0; i < SKIP; i++){
+            auto it = object_at.find(records[i].a);
+            if(it == object_at.end()){
+                it = object_at.insert({records[i].a, objects.size()}).first;
+                objects.emplace_back();
+            }
+            objects[it->second].records.push_back(i);
+            objects[it->second].ordered |= interval_kinds[i] != SKIP_KEYED;
+        }
+
+        struct Key {
+            bool        attribute;
+            PyObject*   key;
+            Py_ssize_t  index;
+            bool operator==(const Key& other) const {
+                return attribute == other.attribute && key == other.key && index == other.index;
+            }
+        };
+        struct KeyHash {
+            size_t operator()(const Key& k) const {
+                return std::hash<PyObject*>()(k.key) * 31 + std::hash<Py_ssize_t>()(k.index) * 2 + k.attribute;
+            }
+        };
+        struct Entry {
+            size_t      record;     // Last write of the key
+            bool        created;    // The key didn't exist before the interval
+            bool        existed;    // The key did exist before the interval
+            bool        reinserted; // Deleted first, so the key moves to the end
+            bool        alive;
+        };
+        std::vector<Mutation> folded;
+        for(auto& object : objects){
+            std::vector<Entry> entries;
+            phmap::flat_hash_map<Key, size_t, KeyHash> at;
+            for(size_t r = 0; r < object.records.size() && !object.ordered; r++){
+                auto& m = records[object.records[r]];
+                Key key = {m.opcode == STORE_ATTR || m.opcode == DELETE_ATTR, m.b, m.index};
+                bool store = m.opcode == STORE_SUBSCR || m.opcode == STORE_ATTR;
+                auto it = at.find(key);
+                if(it == at.end()){
+                    bool created = store && m.prior.known && m.prior.value == NULL;
+                    bool existed = !store || (m.prior.known && m.prior.value != NULL);
+                    at[key] = entries.size();
+                    entries.push_back({object.records[r], created, existed, false, true});
+                    continue;
+                }
+                auto& entry = entries[it->second];
+                auto& last = records[entry.record];
+                bool deleted = last.opcode == DELETE_SUBSCR || last.opcode == DELETE_ATTR;
+                if(store && deleted){
+                    entry.alive = false;
+                    it->second = entries.size();
+                    entries.push_back({object.records[r], false, true, true, true});
+                } else if(store){
+                    entry.record = object.records[r];
+                } else if(entry.created){
+                    entry.alive = false;        // Added and deleted again
+                    at.erase(it);
+                } else if(entry.existed){
+                    entry.record = object.records[r];
+                    entry.reinserted = false;
+                } else {
+                    object.ordered = true;      // Can't tell whether the delete is needed
+                }
+            }
+            if(object.ordered){
+                for(auto r : object.records){
+                    folded.push_back(records[r]);
+                }
+                continue;
+            }
+            for(auto& entry : entries){
+                if(!entry.alive){
+                    continue;
+                }
+                if(entry.reinserted){
+                    auto removal = records[entry.record];
+                    removal.opcode = removal.opcode == STORE_ATTR ? DELETE_ATTR : DELETE_SUBSCR;
+                    removal.c = NULL;
+                    folded.push_back(removal);
+                }
+                folded.push_back(records[entry.record]);
+            }
+        }
+        if(folded.size() > SKIP / 2){
+            return;     // Not worth keeping
+        }
+
+        // Written like the interval's records, all at its last step
+        std::unique_ptr<Stream> skip(new Stream());
+        for(auto& m : folded){
+            write(*skip, records.back().step - skip->last_step);
+            skip->last_step = records.back().step;
+            bool inline_key = m.b == NULL && m.index >= 0;
+            skip->bytes.push_back(inline_key ? m.opcode | 0x80 : m.opcode);
+            write(*skip, intern(m.a));
+            write(*skip, inline_key ? (size_t)m.index : intern(m.b));
+            write(*skip, intern(m.c));
+            write(*skip, 1);
+            skip->count++;
+        }
+        skip->last_step = records.back().step;
+        skip->bytes.shrink_to_fit();
+        skips[interval] = std::move(skip);
+    }
+
+    static void write(Stream& stream, size_t value){
+        while(value >= 0x80){
+            stream.bytes.push_back((unsigned char)(value | 0x80));
+            value >>= 7;
+        }
+        stream.bytes.push_back((unsigned char)value);
+    }
+
+    Reader seek(const Stream& stream, size_t step) const {
+        auto& checkpoints = stream.checkpoints;
+        size_t lo = 0, hi = checkpoints.size();
+        while(hi - lo > 1){
+            size_t mid = (lo + hi) / 2;
+            if(checkpoints[mid].step < step){
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        Reader reader(this, &stream, lo);
+        Reader ahead = reader; Mutation m;
+        while(ahead.next(m) && m.step < step){
+            reader = ahead;
+        }
+        return reader;
+    }
+
+    static size_t stream_memory(const Stream& stream){
+        return stream.bytes.capacity() + stream.checkpoints.capacity() * sizeof(Checkpoint);
+    }
+
+    size_t intern(PyObject* obj){
+        if(obj == NULL){
+            return 0;
+        }
+        auto it = table_index.find(obj);
+        if(it != table_index.end()){
+            return it->second;
+        }
+        table.push_back(obj);
+        table_index[obj] = table.size() - 1;
+        return table.size() - 1;
+    }
+
+    Stream                                      object_stream;
+    Stream                                      binding_stream;
+    std::vector<PyObject*>                      table;          // Borrowed, like the raw tuples were
+    phmap::flat_hash_map<PyObject*, size_t>     table_index;
+    phmap::flat_hash_map<CallId, Bindings>      bindings;       // Name bindings of each call instance, up to 'indexed'
+    phmap::flat_hash_map<PyObject*, Bindings>   names;          // Name bindings of each name, up to 'indexed'
+    Checkpoint                                  indexed = {0, 0};   // Where index_bindings() got to
+    size_t                                      indexed_count = 0;
+    phmap::flat_hash_map<CallId, std::vector<NameTable>> name_tables;  // Every NAME_SKIP bindings of each call
+    std::vector<std::unique_ptr<Stream>>        skips;          // Table of each interval of SKIP object mutations, if any
+    std::vector<SkipKind>                       interval_kinds; // Of the object mutations since the last full interval
+    size_t                                      start_step = 0;
+};
@@ -0,0 +1,45 @@
+import execorder
+
+# A few names out of a large state, some sharing objects
+code = '''
+class P:
+    pass
+
+big = [[j] * 50 for j in range(2000)]
+X = [1, 2]
+Z = X
+W = [X, {'x': X}]
+p = P()
+p.v = W
+for i in range(300):
+    X[i % 2] = i
+    big[i][0] = -i
+    p.n = i
+del Z
+'''
+
+recording = execorder.exec(code)
+N = recording.steps()
+
+# States computed the plain way, with every name
+reference = execorder.exec(code)
+reference.cache_bytes = 0
+
+def shown(value):
+    return repr(vars(value) if hasattr(value, '__dict__') else value)
+
+for n in list(range(0, N, 7)) + [N - 1]:
+    full = reference.state(n)
+    for names in (['X'], ['W', 'Z'], ['p', 'X'], ['big', 'i'], ['Z', 'missing']):
+        state = recording.state(n, names=names)
+        assert set(state) == set(names) & set(full), (n, names, set(state))
+        for name in state:
+            assert shown(state[name]) == shown(full[name]), (n, name, shown(state[name]), shown(full[name]))
+
+        # Names still share objects, as in the full state
+        if 'W' in state and 'Z' in state:
+            assert state['W'][0] is state['Z'] and state['W'][1]['x'] is state['Z'], n
+        if 'p' in state and 'X' in state:
+            assert state['p'].v[0] is state['X'], n
+
+print('OK')
@@ -0,0 +1,83 @@
+import sys
+import execorder
+
+code = '''
+def fib(n):
+    if n < 2:
+        return n
+    return fib(n - 1) + fib(n - 2)
+
+def gen():
+    for i in range(3):
+        yield i
+
+def boom():
+    raise ValueError()
+
+total = 0
+for i in range(40):
+    total += fib(i % 7)
+G = list(gen())
+try:
+    boom()
+except ValueError:
+    pass
+Q = sorted([3, 1, 2], key=lambda v: -v)
+'''
+
+# Call instance and depth of every step, traced the plain way
+steps = []
+stack, frames, counter = [], {}, [0]
+def trace(frame, event, arg):
+    if frame.f_code.co_filename != '<execorder>':
+        return None
+    if event == 'call':
+        counter[0] += 1
+        frames[id(frame)] = counter[0]
+        stack.append(counter[0])
+    steps.append((frames[id(frame)], len(stack) - 1, event, frame.f_code.co_name))
+    if event == 'return':
+        stack.pop()
+        del frames[id(frame)]
+    return trace
+sys.settrace(trace)
+exec(compile(code, '<execorder>', 'exec'), {})
+sys.settrace(None)
+
+recording = execorder.exec(code)
+N = recording.steps()
+assert N == len(steps), (N, len(steps))
+
+def next_in_frame(n):
+    for m in range(n + 1, N):
+        if steps[m][0] == steps[n][0]:
+            return m
+        if steps[m][1] <= steps[n][1]:
+            return None
+
+def step_over(n):
+    return next((m for m in range(n + 1, N) if steps[m][1] <= steps[n][1]), None)
+
+def step_out(n):
+    last = max(m for m in range(N) if steps[m][0] == steps[n][0])
+    return last + 1 if last + 1 < N and steps[last][2] == 'return' else None
+
+def step_back(n):
+    return next((m for m in range(n - 1, -1, -1) if steps[m][1] <= steps[n][1]), None)
+
+def prev_call(n):
+    calls = [m for m in range(n) if steps[m][2] == 'call' and steps[m][3] == steps[n][3] and steps[m][0] != steps[n][0]]
+    return calls[-1] if calls else None
+
+for n in range(N):
+    for f in (next_in_frame, step_over, step_out, step_back, prev_call):
+        assert getattr(recording, f.__name__)(n) == f(n), (f.__name__, n, steps[n])
+
+# Stepping over a call lands where the call's result is already stored
+line = code.split('\n').index('    total += fib(i % 7)') + 1
+for n in recording.visits(line)[:5]:
+    after = recording.step_over(n)
+    s, t = recording.state(n), recording.state(after)
+    assert t['total'] == s['total'] + [0, 1, 1, 2, 3, 5, 8][s['i'] % 7], (n, s['total'], t['total'])
+
+print('OK')
@@ -0,0 +1,41 @@
+import execorder
+
+code = '''
+X = [3, 1, 2]
+for i in range(len(X) - 1):
+    a, b = X[i], X[i + 1]
+    if a > b:
+        X[i], X[i + 1] = b, a
+'''
+
+swap = code.split('\n').index('        X[i], X[i + 1] = b, a') + 1
+
+by_line = execorder.exec(code)
+by_opcode = execorder.exec(code, granularity='opcode')
+
+# Line granularity steps have no offsets
+assert all(by_line.offset(n) is None for n in range(by_line.steps()))
+
+# At opcode granularity every visit of the swap line is its line step followed
+# by one step per store into X, each seeing the stores before it
+visits = by_opcode.visits(swap)
+assert len(visits) == len(by_line.visits(swap)) == 2
+for n in visits:
+    assert by_opcode.offset(n) is None
+    first, second = n + 1, n + 2
+    assert by_opcode.line(first) == by_opcode.line(second) == swap
+    assert None != by_opcode.offset(first) < by_opcode.offset(second)
+    assert by_opcode.line(second + 1) != swap
+
+    s = by_opcode.state(n)
+    X, i, a, b = s['X'], s['i'], s['a'], s['b']
+    assert by_opcode.state(first)['X'] == X
+    X[i] = b
+    assert by_opcode.state(second)['X'] == X
+    X[i + 1] = a
+    assert by_opcode.state(second + 1)['X'] == X
+
+# Both granularities end in the same state
+assert by_opcode.state(by_opcode.steps() - 1)['X'] == by_line.state(by_line.steps() - 1)['X'] == [1, 2, 3]
+
+print('OK')
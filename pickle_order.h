@@ -0,0 +1,188 @@
+#pragma once
+#include "Python.h"
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <mutex>
+#include "parallel_hashmap/phmap.h"
+
+/*
+    The objects dumped into a Milestone's snapshot, in the order they were
+    dumped, with what is needed to load only some of them again.
+
+    All dumps of a Milestone share one Pickler, so a dump refers to objects
+    that earlier dumps pickled through the pickler's memo instead of
+    repeating them. Besides each dump's byte offset in the stream, the
+    dumps it is linked to are kept: the dump of the object it was found
+    inside (whose pickle holds its contents, linked both ways as loading
+    either loads the other's objects) and the dumps of already pickled
+    objects it contains. Seeking one Unpickler to a set of dumps closed
+    under these links, in order, loads the same objects as reading the
+    whole stream. Following only the links from an object to what it
+    contains gives the objects it held when it was dumped.
+*/
+
+// ==== class PickleOrder ====================
+class PickleOrder {
+public:
+    static const uint32_t NONE = (uint32_t)-1;
+
+    // Index of the new dump
+    uint32_t push_back(PyObject* obj, size_t offset){
+        uint32_t dump = (uint32_t)objects.size();
+        objects.push_back(obj);
+        offsets.push_back(offset);
+        dumps[obj] = dump;
+        return dump;
+    }
+
+    // The object of dump 'child' was pickled as part of dump 'parent'
+    void inside(uint32_t child, uint32_t parent){
+        link(child, parent, true);
+        link(parent, child, false);
+    }
+
+    // Dump 'from' may refer to objects pickled by the earlier dump 'to'
+    void depend(uint32_t from, uint32_t to){
+        link(from, to, false);
+    }
+
+    // Dump that pickled obj, NONE for consts and objects that couldn't be pickled
+    uint32_t dump_of(PyObject* obj) const {
+        auto it = dumps.find(obj);
+        return it == dumps.end() ? NONE : it->second;
+    }
+
+    PyObject* operator[](size_t dump) const {
+        return objects[dump];
+    }
+
+    size_t offset(size_t dump) const {
+        return offsets[dump];
+    }
+
+    size_t size() const {
+        return objects.size();
+    }
+
+    std::vector<PyObject*>::const_iterator begin() const {
+        return objects.begin();
+    }
+
+    std::vector<PyObject*>::const_iterator end() const {
+        return objects.end();
+    }
+
+    // Mark dump and the dumps it is linked to as needed, returns how many weren't already
+    size_t close(uint32_t dump, std::vector<bool>& needed){
+        return walk(dump, needed, true, NULL);
+    }
+
+    // Mark dump and the dumps of the objects it contains as reached, appending those that weren't to 'added'
+    void contents(uint32_t dump, std::vector<bool>& reached, std::vector<uint32_t>& added){
+        walk(dump, reached, false, &added);
+    }
+
+    // The same, marking in a set, for when few of the dumps are reached each time
+    void contents(uint32_t dump, phmap::flat_hash_set<uint32_t>& reached, std::vector<uint32_t>& added){
+        walk(dump, reached, false, &added);
+    }
+
+private:
+    struct Edge {
+        uint32_t    from;
+        uint32_t    to;
+        bool        up;         // 'from' was found inside 'to', doesn't contain it
+    };
+
+    void link(uint32_t from, uint32_t to, bool up){
+        if(from != NONE && to != NONE && from != to){
+            edges.push_back({from, to, up});
+        }
+    }
+
+    static bool is_marked(const std::vector<bool>& marked, uint32_t dump){
+        return marked[dump];
+    }
+
+    static bool is_marked(const phmap::flat_hash_set<uint32_t>& marked, uint32_t dump){
+        return marked.count(dump) != 0;
+    }
+
+    static void mark(std::vector<bool>& marked, uint32_t dump){
+        marked[dump] = true;
+    }
+
+    static void mark(phmap::flat_hash_set<uint32_t>& marked, uint32_t dump){
+        marked.insert(dump);
+    }
+
+    void fit(std::vector<bool>& marked) const {
+        if(marked.size() < objects.size()){
+            marked.resize(objects.size());     // Dumps were added since it was sized (still recording)
+        }
+    }
+
+    void fit(phmap::flat_hash_set<uint32_t>&) const {}
+
+    // Queries of several threads may walk at once (some without the GIL), the edge index is theirs to share
+    template<typename Marked>
+    size_t walk(uint32_t dump, Marked& marked, bool up, std::vector<uint32_t>* added){
+        fit(marked);
+        if(dump == NONE || is_marked(marked, dump)){
+            return 0;
+        }
+        std::lock_guard<std::mutex> indexing(index_lock);
+        index();
+        size_t count = 0;
+        std::vector<uint32_t> pending = {dump};
+        mark(marked, dump);
+        while(!pending.empty()){
+            auto d = pending.back();
+            pending.pop_back();
+            count++;
+            if(added){
+                added->push_back(d);
+            }
+            for(size_t e = first_edge[d]; e < first_edge[d + 1]; e++){
+                if(!is_marked(marked, targets[e]) && (up || !target_up[e])){
+                    mark(marked, targets[e]);
+                    pending.push_back(targets[e]);
+                }
+            }
+        }
+        return count;
+    }
+
+    // Group the edges by the dump they start from, again only when there are new ones
+    void index(){
+        if(indexed_edges == edges.size() && first_edge.size() == objects.size() + 1){
+            return;
+        }
+        first_edge.assign(objects.size() + 1, 0);
+        for(auto& edge : edges){
+            first_edge[edge.from + 1]++;
+        }
+        for(size_t d = 0; d < objects.size(); d++){
+            first_edge[d + 1] += first_edge[d];
+        }
+        targets.resize(edges.size());
+        target_up.resize(edges.size());
+        std::vector<size_t> next(first_edge.begin(), first_edge.end() - 1);
+        for(auto& edge : edges){
+            target_up[next[edge.from]] = edge.up;
+            targets[next[edge.from]++] = edge.to;
+        }
+        indexed_edges = edges.size();
+    }
+
+    std::vector<PyObject*>      objects;
+    std::vector<size_t>         offsets;        // Byte offset of each dump in the snapshot
+    phmap::flat_hash_map<PyObject*, uint32_t> dumps;
+    std::vector<Edge>           edges;
+    std::vector<size_t>         first_edge;     // Edges of dump d are targets[first_edge[d], first_edge[d + 1])
+    std::vector<uint32_t>       targets;
+    std::vector<bool>           target_up;      // Edge::up of each of targets
+    size_t                      indexed_edges = 0;
+    std::mutex                  index_lock;     // Held while the index is rebuilt or followed
+};
@@ -0,0 +1,40 @@
+import random
+import execorder
+
+code = '''
+X = [0] * 10
+D = {}
+for i in range(15000):
+    X[i % 10] = i
+    D[i % 3] = X[:2]
+    if i % 1000 == 0:
+        X = X[::-1]
+'''
+
+def shown(state):
+    return repr(sorted((name, value) for name, value in state.items() if name in ('X', 'D', 'i')))
+
+recording = execorder.exec(code)
+N = recording.steps()
+rnd = random.Random(1)
+
+# Queries that go back a little, forward a little, and jump, in any order
+steps = []
+for _ in range(40):
+    n = rnd.randrange(N)
+    steps += [n, max(0, n - 1), min(N - 1, n + 1), max(0, n - rnd.randrange(3000)), min(N - 1, n + rnd.randrange(3000))]
+steps += [0, N - 1, 0, N // 2, N - 1]
+
+# States computed the plain way: a cursor stepping through every mutation in order
+reference = execorder.exec(code)
+reference.cache_bytes = 0
+wanted = set(steps)
+expected = {n: shown(state) for n, state in enumerate(reference.cursor().iter(0, N)) if n in wanted}
+
+for n in steps:
+    assert shown(recording.state(n)) == expected[n], n
+cursor = recording.cursor()
+for n in steps:
+    assert shown(cursor.seek(n)) == expected[n], n
+
+print('OK')
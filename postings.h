@@ -0,0 +1,108 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+/*
+    An ascending list of step numbers (e.g. every step that visited a line).
+
+    Steps are delta-varint encoded in blocks of BLOCK entries. Each block
+    header holds the block's first step and its byte offset, so lookups and
+    range counts binary search the headers and decode at most one block.
+*/
+
+// ==== class PostingList ====================
+class PostingList {
+public:
+    static const size_t BLOCK = 128;
+
+    void push_back(size_t step){
+        if(length % BLOCK == 0){
+            blocks.push_back({step, bytes.size()});
+        } else {
+            size_t delta = step - last;
+            while(delta >= 0x80){
+                bytes.push_back((unsigned char)(delta | 0x80));
+                delta >>= 7;
+            }
+            bytes.push_back((unsigned char)delta);
+        }
+        last = step;
+        length++;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    size_t operator[](size_t i) const {
+        size_t step = 0;
+        each(i, i + 1, [&](size_t s){ step = s; });
+        return step;
+    }
+
+    // Index of the first entry >= step
+    size_t lower_bound(size_t step) const {
+        if(length == 0 || step <= blocks[0].first){
+            return 0;
+        }
+        size_t lo = 0, hi = blocks.size();   // blocks[lo].first < step
+        while(hi - lo > 1){
+            size_t mid = (lo + hi) / 2;
+            if(blocks[mid].first < step){
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        size_t i = lo * BLOCK, end = std::min(length, i + BLOCK);
+        each(i, end, [&](size_t s){ i += s < step; });
+        return i;
+    }
+
+    // Number of entries in [start, stop)
+    size_t count(size_t start, size_t stop) const {
+        return stop <= start ? 0 : lower_bound(stop) - lower_bound(start);
+    }
+
+    // Call f(step) for the entries with index in [from, to)
+    template<typename F>
+    void each(size_t from, size_t to, F f) const {
+        to = std::min(to, length);
+        size_t i = from - from % BLOCK;
+        while(i < to){
+            auto& block = blocks[i / BLOCK];
+            size_t step = block.first, position = block.offset;
+            size_t block_end = std::min(to, i + BLOCK);
+            for(; i < block_end; i++){
+                if(i % BLOCK != 0){
+                    size_t delta = 0; unsigned shift = 0; unsigned char byte;
+                    do {
+                        byte = bytes[position++];
+                        delta |= (size_t)(byte & 0x7F) << shift;
+                        shift += 7;
+                    } while(byte & 0x80);
+                    step += delta;
+                }
+                if(i >= from){
+                    f(step);
+                }
+            }
+        }
+    }
+
+    size_t memory() const {
+        return bytes.capacity() + blocks.capacity() * sizeof(Block);
+    }
+
+private:
+    struct Block {
+        size_t first;           // First step in the block
+        size_t offset;          // Byte offset of the block's second entry
+    };
+
+    std::vector<unsigned char>  bytes;
+    std::vector<Block>          blocks;
+    size_t                      length = 0;
+    size_t                      last = 0;
+};
@@ -0,0 +1,63 @@
+import os
+import threading
+import execorder
+
+class Probe:
+    # Its clones tell which process cloned them
+    def __deepcopy__(self, memo):
+        clone = Probe()
+        clone.pid = os.getpid()
+        return clone
+
+code = '''
+from __main__ import Probe
+M = [Probe()]
+R = [__import__('json'), len, {'dumps': __import__('json').dumps}]
+X = []
+for i in range(300):
+    X = X + [i]
+    if i % 7 == 0:
+        X[0] = -i
+'''
+
+recording = execorder.exec(code)
+N = recording.steps()
+steps = list(range(0, N, 3)) + [N - 1, 5, 5]
+
+def check(states):
+    assert len(states) == len(steps)
+    for n, state in zip(steps, states):
+        want = recording.state(n)
+        assert state.keys() == want.keys(), n
+        assert state.get('X') == want.get('X') and state.get('R') == want.get('R'), n
+
+# Worker results are used, including states holding modules, rather than recomputed here
+states = recording.states(steps, processes=2)
+check(states)
+pids = [state['M'][0].pid for state in states if 'M' in state]
+assert pids and all(pid != os.getpid() for pid in pids), pids
+assert recording.states(steps, processes=1)[-1]['M'][0].pid == os.getpid()
+
+# Forking while other threads query
+done = []
+errors = []
+def query():
+    n = 0
+    while not done:
+        try:
+            recording.state(n)
+            recording.state(n, names=['X'])
+        except Exception as e:
+            errors.append(e)
+        n = (n + 97) % N
+threads = [threading.Thread(target=query) for i in range(3)]
+for thread in threads:
+    thread.start()
+for i in range(5):
+    check(recording.states(steps, processes=3))
+done.append(True)
+for thread in threads:
+    thread.join()
+assert not errors, errors
+
+print('OK')
@@ -0,0 +1,63 @@
+import sys
+import execorder
+
+code = '''
+def fib(n):
+    if n < 2:
+        return n
+    return fib(n - 1) + fib(n - 2)
+
+def gen(k):
+    for i in range(k):
+        yield i
+
+total = 0
+for x in gen(5):
+    total += fib(x + 8)
+'''
+
+recording = execorder.exec(code, timing=True)
+N = recording.steps()
+lines = code.split('\n')
+
+# Times never go backwards, and step_at_time() inverts time()
+times = [recording.time(n) for n in range(N)]
+assert times[0] == 0 and times == sorted(times)
+for n in range(0, N, 97):
+    assert recording.time(recording.step_at_time(times[n])) == times[n]
+
+profile = recording.profile()
+end = times[-1]
+
+# Every step's time is the self time of exactly one line and one function
+assert abs(sum(s for _, s, _ in profile['lines'].values()) - end) < 1e-6
+assert abs(sum(s for _, s, _ in profile['functions'].values()) - end) < 1e-6
+
+# Line hits and calls match the counts made by tracing the code the plain way
+hits, calls = {}, {}
+def trace(frame, event, arg):
+    if frame.f_code.co_filename == '<plain>':
+        if event == 'line':
+            hits[frame.f_lineno] = hits.get(frame.f_lineno, 0) + 1
+        return trace
+sys.settrace(trace)
+exec(compile(code, '<plain>', 'exec'), {})
+sys.settrace(None)
+
+assert {line: count for line, (count, _, _) in profile['lines'].items() if count} == hits
+for line, (count, self_time, inclusive) in profile['lines'].items():
+    assert 0 <= self_time <= inclusive <= end + 1e-9, (line, self_time, inclusive)
+
+counts = recording.call_counts()
+for key, (calls, self_time, inclusive) in profile['functions'].items():
+    assert calls == counts[key], (key, calls, counts[key])
+    assert 0 <= self_time <= inclusive <= end + 1e-9, (key, self_time, inclusive)
+
+# fib's inclusive time isn't counted again for each level of recursion, and
+# the loop line calling it includes it
+fib = profile['functions'][('fib', 2)]
+assert fib[2] <= end
+call_line = lines.index('    total += fib(x + 8)') + 1
+assert profile['lines'][call_line][2] >= fib[2] - 1e-6
+
+print('OK')
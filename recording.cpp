@@ -15,298 +15,2455 @@ auto DEBUG_TIME_VAL = std::chrono::high_resolution_clock::now();
 //===============================================================
 
 #include "recording.h"
+#include "visits.h"
+#include "cursor.h"
+#include "state_mapping.h"
 #include "structmember.h"
 #include "opcode.h"
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+static uint64_t clock_ns(){
+    static LARGE_INTEGER frequency = {0};
+    if(frequency.QuadPart == 0){
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart * (1e9 / frequency.QuadPart));
+}
+#else
+#include <time.h>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/wait.h>
+static uint64_t clock_ns(){
+    struct timespec now;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);   // Not slewed by NTP, cheap through the vDSO
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+#endif
 
 PyObject* io_module = NULL;
 PyObject* pickle_module = NULL;
+PyObject* copy_module = NULL;
 auto pickler_str = PyUnicode_FromString("Pickler");
 auto unpickler_str = PyUnicode_FromString("Unpickler");
 auto dump_str = PyUnicode_FromString("dump");
+auto tell_str = PyUnicode_FromString("tell");
 auto bytesio_str = PyUnicode_FromString("BytesIO");
+auto deepcopy_str = PyUnicode_FromString("deepcopy");
+auto hash_str = PyUnicode_InternFromString("__hash__");
+auto eq_str = PyUnicode_InternFromString("__eq__");
 
 //PyObject* Recording_check_const(RecordingObject*, PyObject*&);
 bool Recording_check_const(RecordingObject*, PyObject*&);
 
+/*
+    Snapshots pickle classes and functions by address rather than by name:
+    those the recorded code defines can't be looked up by name, and objects
+    of its classes couldn't be saved otherwise. They are consts, alive in
+    the consts dict for as long as the recording is.
+*/
+static PyObject* Recording_snapshot_id(PyObject* capsule, PyObject* obj){
+    if((PyType_Check(obj) && PyType_HasFeature((PyTypeObject*)obj, Py_TPFLAGS_HEAPTYPE)) || PyFunction_Check(obj)){
+        auto self = (RecordingObject*)PyCapsule_GetPointer(capsule, NULL);
+        auto saved = obj;
+        if(Recording_check_const(self, saved) && saved == obj){
+            return PyLong_FromVoidPtr(obj);
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* Recording_persistent_load(PyObject* self, PyObject* pid){
+    if(PyUnicode_Check(pid)){
+        return PyImport_Import(pid);
+    }
+    auto obj = (PyObject*)PyLong_AsVoidPtr(pid);
+    Py_XINCREF(obj);
+    return obj;
+}
+
+static PyMethodDef snapshot_id_def = {"persistent_id", (PyCFunction)Recording_snapshot_id, METH_O, NULL};
+static PyMethodDef persistent_load_def = {"persistent_load", (PyCFunction)Recording_persistent_load, METH_O, NULL};
+static PyObject* persistent_load = PyCFunction_New(&persistent_load_def, NULL);
+
+static PyObject* Recording_unpickler(PyObject* stream){
+    // Unpickler of snapshot bytes, or of a worker's states (see Recording_fork_batch)
+    auto unpickler = PyObject_CallMethodObjArgs(pickle_module, unpickler_str, stream, NULL);
+    if(unpickler != NULL){
+        PyObject_SetAttrString(unpickler, "persistent_load", persistent_load);
+    }
+    return unpickler;
+}
+
 static void Recording_new_milestone(RecordingObject* self){
     self->pickle_order = new PickleOrder();
-    self->mutations = new MutationList(); 
-    self->mutations->reserve(200000);
+    self->mutations = new MutationLog();
 
     Py_XDECREF(self->pickler);  // Forget the Pickler, we keep the BytesIO it wrote to
     auto pickle_bytes = PyObject_CallMethodObjArgs(io_module, bytesio_str, NULL);  
     self->pickler = PyObject_CallMethodObjArgs(pickle_module, pickler_str, pickle_bytes, NULL);
+    auto capsule = PyCapsule_New(self, NULL, NULL);     // Not a reference, the Pickler is the recording's
+    auto snapshot_id = PyCFunction_New(&snapshot_id_def, capsule);
+    PyObject_SetAttrString(self->pickler, "persistent_id", snapshot_id);
+    Py_DECREF(snapshot_id); Py_DECREF(capsule);
 
     auto milestone = Milestone(self->mutations, self->pickle_order, pickle_bytes);
-    self->milestones.push_back(milestone);
+    {
+        auto writing = Recording_writing(self);
+        self->milestones.push_back(milestone);
+        self->milestone_steps.push_back(self->lines.size());    // Its snapshot is taken before this step
+    }
 
     self->tracked_objects.clear();
+    self->pickle_parent = PickleOrder::NONE;
     self->fresh_milestone = true;  // Make sure we take full memory snapshot
 }
 
-static PyObject* Recording_new(PyTypeObject *type, PyObject *args, PyObject *kwds){
-    auto self = (RecordingObject*)type->tp_alloc(type, 0);
-    self->tracked_objects = ObjectSet();
-    self->steps.reserve(10000);
-    self->visits = PyList_New(0);
-    self->consts = PyDict_New();
-    self->objects = ObjectMap();
-    self->global_frame = NULL;
-    self->callback_counter = 0;
-    self->pickler = NULL;
-    Recording_new_milestone(self);
-    return (PyObject*) self;
+static PyObject* Recording_new(PyTypeObject *type, PyObject *args, PyObject *kwds){
+    auto self = (RecordingObject*)type->tp_alloc(type, 0);
+    // tp_alloc only zeroes memory, C++ members need constructing in place
+    new (&self->tracked_objects) ObjectSet();
+    new (&self->lines) PatternColumn<int>();
+    new (&self->events) PackedColumn<2>();
+    new (&self->calls) PatternColumn<CallId>();
+    new (&self->offsets) Column<StepOffset>();
+    new (&self->live_calls) CallMap();
+    new (&self->called_code) std::vector<PyObject*>();
+    new (&self->milestones) std::vector<Milestone>();
+    new (&self->milestone_steps) std::vector<size_t>();
+    new (&self->replay) ReplayState();
+    new (&self->tail) ReplayState();
+    new (&self->cache) MilestoneCache();
+    new (&self->lock) std::shared_timed_mutex();
+    self->cache_bytes = 32 << 20;
+    new (&self->times) TimeColumn();
+    new (&self->call_records) std::vector<CallRecord>();
+    new (&self->depths) MinimaColumn<uint32_t>();
+    new (&self->call_stack) std::vector<CallId>();
+    new (&self->function_calls) FunctionCalls();
+    new (&self->visits) std::vector<PostingList>();
+    self->consts = PyDict_New();
+    self->global_call = NO_CALL;
+    self->callback_counter = 0;
+    self->pickler = NULL;
+    Recording_new_milestone(self);
+    return (PyObject*) self;
+}
+
+static void Recording_dealloc(RecordingObject *self){
+    Py_DECREF(self->pickler);
+    Py_DECREF(self->code);
+    Py_DECREF(self->consts);
+    MutationLog* mutations; PickleOrder* pickle_order; PyObject* pickle_bytes;
+    for(auto& milestone : self->milestones){
+        std::tie(mutations, pickle_order, pickle_bytes) = milestone;
+        delete mutations;
+        delete pickle_order;
+        Py_DECREF(pickle_bytes);
+    }
+    self->pickle_order = NULL;
+    self->tracked_objects.~ObjectSet();
+    self->lines.~PatternColumn<int>();
+    self->events.~PackedColumn<2>();
+    self->calls.~PatternColumn<CallId>();
+    self->offsets.~Column<StepOffset>();
+    self->times.~TimeColumn();
+    self->live_calls.~CallMap();
+    self->called_code.~vector<PyObject*>();
+    self->call_records.~vector<CallRecord>();
+    self->depths.~MinimaColumn<uint32_t>();
+    self->call_stack.~vector<CallId>();
+    self->function_calls.~FunctionCalls();
+    self->lock.~shared_timed_mutex();
+    self->visits.~vector<PostingList>();
+    self->milestones.~vector<Milestone>();
+    self->milestone_steps.~vector<size_t>();
+    self->replay.~ReplayState();
+    self->tail.~ReplayState();
+    self->cache.~MilestoneCache();
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static void inplace_opcode(int opcode, PyObject* target, PyObject* obj){
+    PyObject* result = NULL;
+
+    switch(opcode){
+        case INPLACE_POWER:
+            result = PyNumber_InPlacePower(target, obj, Py_None);
+            break;
+        case INPLACE_MULTIPLY:
+            result = PyNumber_InPlaceMultiply(target, obj);
+            break;
+        case INPLACE_MATRIX_MULTIPLY:
+            result = PyNumber_InPlaceMatrixMultiply(target, obj);
+            break;
+        case INPLACE_TRUE_DIVIDE:
+            result = PyNumber_InPlaceTrueDivide(target, obj);
+            break;
+        case INPLACE_FLOOR_DIVIDE:
+            result = PyNumber_InPlaceFloorDivide(target, obj);
+            break;
+        case INPLACE_MODULO:
+            result = PyNumber_InPlaceRemainder(target, obj);
+            break;
+        case INPLACE_ADD:
+            // TODO: unicode stuff
+            result = PyNumber_InPlaceAdd(target, obj);
+            break;
+        case INPLACE_SUBTRACT:
+            result = PyNumber_InPlaceSubtract(target, obj);
+            break;
+        case INPLACE_LSHIFT:
+            result = PyNumber_InPlaceLshift(target, obj);
+            break;
+        case INPLACE_RSHIFT:
+            result = PyNumber_InPlaceRshift(target, obj);
+            break;
+        case INPLACE_AND:
+            result = PyNumber_InPlaceAnd(target, obj);
+            break;
+        case INPLACE_XOR:
+            result = PyNumber_InPlaceXor(target, obj);
+            break;
+        case INPLACE_OR:
+            result = PyNumber_InPlaceOr(target, obj);
+            break;
+        default:
+            printf("UNKNOWN OPCODE %d\n", opcode);
+    }
+
+    // Immutable objects (e.g. ints) return a new object, which gets its own
+    // name binding. Only an object that really changed in place is a mutation.
+    Py_XDECREF(result);
+}
+
+static bool Recording_step_range(PyObject* start_obj, PyObject* stop_obj, size_t& start, size_t& stop){
+    // Optional [start, stop) arguments of range queries, None meaning unbounded
+    if(start_obj != NULL && start_obj != Py_None){
+        auto n = PyLong_AsLong(start_obj);
+        start = n > 0 ? n : 0;
+    }
+    if(stop_obj != NULL && stop_obj != Py_None){
+        auto n = PyLong_AsLong(stop_obj);
+        stop = n > 0 ? n : 0;
+    }
+    return !PyErr_Occurred();
+}
+
+static bool Recording_clamp_step(RecordingObject* recording, long n, size_t& step){
+    // Nearest recorded step to n, steps below steps() are complete even while the code is running
+    auto steps = recording->lines.size();
+    if(steps == 0){
+        PyErr_SetString(PyExc_IndexError, "recording has no steps yet");
+        return false;
+    }
+    step = (size_t)std::min((long)steps - 1, std::max(0L, n));
+    return true;
+}
+
+size_t Recording_milestone_at(RecordingObject* recording, size_t step){
+    // Last Milestone that started at or before 'step'
+    auto& starts = recording->milestone_steps;
+    auto it = std::upper_bound(starts.begin(), starts.end(), step);
+    return it == starts.begin() ? 0 : (it - starts.begin()) - 1;
+}
+
+static MutationLog* Recording_indexed(RecordingObject* recording, size_t milestone){
+    // A Milestone's log with its bindings indexed up to the last one recorded. Called with the GIL,
+    // queries reading the log without it are kept out while the index grows.
+    auto mutations = std::get<0>(recording->milestones[milestone]);
+    if(!mutations->bindings_indexed()){
+        auto writing = Recording_writing(recording);
+        mutations->index_bindings();
+    }
+    return mutations;
+}
+
+static void Recording_replay_mutation(ReplayState& state, const MutationLog* log, const Mutation& mutation){
+    // Apply a mutation of an object (not a name binding) to its replayed copy. Exact lists, dicts
+    // and sets go straight to their own C API rather than through the generic protocols. One that
+    // fails on the copy (it failed in the program too, or holds an object that couldn't be saved)
+    // is skipped, the copy keeps its value from before it.
+    auto target = state.copy_at(log, mutation.ref_a);
+    if(target == NULL){
+        return;     // A const, or couldn't be saved, so there is nothing to replay
+    }
+    auto c = mutation.c ? state.value_at(log, mutation.ref_c) : NULL;  // Store the replayed copy, not the live object
+    bool inline_key = mutation.b == NULL && mutation.index >= 0;
+    if(inline_key && mutation.opcode == STORE_SUBSCR && PyList_CheckExact(target)
+       && mutation.index < PyList_GET_SIZE(target)){
+        auto old = PyList_GET_ITEM(target, mutation.index);
+        Py_INCREF(c);
+        PyList_SET_ITEM(target, mutation.index, c);
+        Py_DECREF(old);
+        return;
+    }
+    auto b = inline_key ? PyLong_FromSsize_t(mutation.index) : mutation.b;
+    bool dict = PyDict_CheckExact(target);
+    switch(mutation.opcode){
+        case STORE_ATTR:    // a.b = c
+            PyObject_SetAttr(target, b, c);
+            break;
+        case STORE_SUBSCR:  // a[b] = c
+            dict ? PyDict_SetItem(target, b, c) : PyObject_SetItem(target, b, c);
+            break;
+        case DELETE_ATTR:   // del a.b
+            PyObject_DelAttr(target, b);
+            break;
+        case DELETE_SUBSCR: // del a[b]
+            dict ? PyDict_DelItem(target, b) : PyObject_DelItem(target, b);
+            break;
+        default: {
+            auto operand = state.value_at(log, mutation.ref_b);
+            if(mutation.opcode == INPLACE_ADD && PyList_CheckExact(target)){
+                Py_XDECREF(_PyList_Extend((PyListObject*)target, operand));
+            } else if(mutation.opcode == INPLACE_OR && Py_TYPE(target) == &PySet_Type && PyAnySet_Check(operand)){
+                _PySet_Update(target, operand);
+            } else {
+                inplace_opcode(mutation.opcode, target, operand);
+            }
+        }
+    }
+    if(inline_key){
+        Py_DECREF(b);
+    }
+    if(PyErr_Occurred()){
+        PyErr_Clear();
+    }
+}
+
+// ==== Query planning ====================
+/*
+    A ReplayState holds the replayed objects of one Milestone at one step.
+    A query can get its objects from the start of the Milestone (load the
+    snapshot, then replay) or, when it is in the same Milestone, by moving
+    on from where the state was left: replaying forwards, or undoing
+    mutations backwards with the prior values saved in their records. Each
+    source is costed in mutations to apply, and the cheapest one wins.
+*/
+const size_t UNPICKLE_COST = 2;     // Cost of loading one object, in replayed mutations
+const size_t REPLAY_RUN = 16384;    // Mutations decoded at a time when replaying
+
+struct ReplayPlan {
+    ReplaySource    source;
+    size_t          milestone;
+    size_t          cost;
+};
+
+static ReplayPlan Recording_plan_replay(RecordingObject* recording, ReplayState& state, size_t step){
+    auto milestone = Recording_milestone_at(recording, step);
+    auto mutations = std::get<0>(recording->milestones[milestone]);
+    auto pickle_order = std::get<1>(recording->milestones[milestone]);
+    auto until = mutations->count_until(step);
+
+    ReplayPlan plan = {FROM_MILESTONE, milestone, pickle_order->size() * UNPICKLE_COST + until};
+    size_t added = state.milestone == milestone ? pickle_order->size() - state.dumps : 0;
+    if(added != 0 && state.unpickler == NULL){
+        return plan;    // Objects were dumped since it was loaded, which it has no copies of
+    }
+    if(state.milestone == milestone && state.step <= step){
+        size_t cost = added * UNPICKLE_COST + until - mutations->count_until(state.step);
+        if(cost < plan.cost){
+            plan = {FROM_CACHE, milestone, cost};
+        }
+    } else if(state.milestone == milestone){
+        size_t cost = mutations->count_until(state.step) - until;
+        if(cost < plan.cost){
+            plan = {UNDO_FROM_CACHE, milestone, cost};
+        }
+    }
+    return plan;
+}
+
+static void Recording_load_added(RecordingObject* recording, ReplayState& state){
+    // Unpickle the dumps added to the state's Milestone since it was loaded, copying only the
+    // snapshot's new bytes. Dumps are pushed once pickled, so those counted are all in the bytes.
+    PickleOrder* pickle_order; PyObject* pickle_bytes;
+    std::tie(std::ignore, pickle_order, pickle_bytes) = recording->milestones[state.milestone];
+    auto dumps = pickle_order->size();
+    if(state.dumps == dumps){
+        return;
+    }
+
+    // getbuffer() doesn't shrink the Pickler's buffer like getvalue() would, the view is
+    // released before the Pickler can write again
+    auto view = PyObject_CallMethod(pickle_bytes, "getbuffer", NULL);
+    Py_buffer buffer;
+    if(view == NULL || PyObject_GetBuffer(view, &buffer, PyBUF_SIMPLE) != 0){
+        Py_XDECREF(view);
+        PyErr_Clear();
+        return;
+    }
+    auto added = PyBytes_FromStringAndSize((char*)buffer.buf + state.bytes, buffer.len - state.bytes);
+    state.bytes = buffer.len;
+    PyBuffer_Release(&buffer);
+    Py_XDECREF(PyObject_CallMethod(view, "release", NULL));
+    Py_DECREF(view);
+
+    if(state.stream == NULL){
+        state.stream = PyObject_CallMethodObjArgs(io_module, bytesio_str, added, NULL);
+        state.unpickler = Recording_unpickler(state.stream);
+    } else {
+        Py_XDECREF(PyObject_CallMethod(state.stream, "seek", "ii", 0, 2));
+        Py_XDECREF(PyObject_CallMethod(state.stream, "write", "O", added));
+    }
+    Py_DECREF(added);
+    for(auto dump = state.dumps; dump < dumps; dump++){
+        auto position = PyObject_CallMethod(state.stream, "seek", "n", (Py_ssize_t)pickle_order->offset(dump));
+        auto obj = position ? PyObject_CallMethod(state.unpickler, "load", NULL) : NULL;
+        if(obj == NULL){
+            PyErr_Clear();
+        } else {
+            state.objects[(*pickle_order)[dump]] = obj;
+        }
+        Py_XDECREF(position);
+    }
+    state.dumps = dumps;
+}
+
+static void Recording_load_milestone(RecordingObject* recording, ReplayState& state, size_t milestone){
+    // Unpickle the objects saved at the start of the Milestone
+    PickleOrder* pickle_order; PyObject* pickle_bytes;
+    std::tie(std::ignore, pickle_order, pickle_bytes) = recording->milestones[milestone];
+
+    state.clear();
+    state.milestone = milestone;
+    if(recording->running && milestone + 1 == recording->milestones.size()){
+        Recording_load_added(recording, state);     // Still recording, later queries load what is added
+        return;
+    }
+
+    // getvalue() hands out the BytesIO's own buffer once it stops growing, so a finished
+    // Milestone's snapshot isn't copied
+    auto bytes = PyObject_CallMethod(pickle_bytes, "getvalue", NULL);
+    state.bytes = PyBytes_GET_SIZE(bytes);
+    auto bytesio = PyObject_CallMethodObjArgs(io_module, bytesio_str, bytes, NULL);
+    auto unpickler = Recording_unpickler(bytesio);
+    for(size_t dump = 0; dump < pickle_order->size(); dump++){
+        auto obj = PyObject_CallMethod(unpickler, "load", NULL);
+        if(obj == NULL){
+            // Left without a copy like objects that couldn't be pickled, the next dump is loaded from its offset
+            PyErr_Clear();
+            if(dump + 1 < pickle_order->size()){
+                Py_XDECREF(PyObject_CallMethod(bytesio, "seek", "n", (Py_ssize_t)pickle_order->offset(dump + 1)));
+            }
+        } else {
+            state.objects[(*pickle_order)[dump]] = obj;
+        }
+    }
+    state.dumps = pickle_order->size();
+    Py_DECREF(unpickler); Py_DECREF(bytesio); Py_DECREF(bytes);
+}
+
+static bool Recording_undo_mutation(ReplayState& state, const Mutation& mutation){
+    // Put back what a replayed mutation overwrote, false if that wasn't saved
+    if(!mutation.prior.known){
+        return false;
+    }
+    auto target = state.copy_of(mutation.a);
+    if(target == NULL){
+        return true;        // Wasn't replayed either
+    }
+    auto b = mutation.b;
+    auto prior = mutation.prior.value ? state.value(mutation.prior.value) : NULL;
+    bool inline_key = b == NULL && mutation.index >= 0;
+    if(inline_key){
+        b = PyLong_FromSsize_t(mutation.index);
+    }
+    switch(mutation.opcode){
+        case STORE_SUBSCR:  // a[b] = c
+            prior ? PyObject_SetItem(target, b, prior) : PyObject_DelItem(target, b);
+            break;
+        case DELETE_SUBSCR: // del a[b]
+            if(PyList_CheckExact(target) && PyLong_Check(b)){
+                auto i = PyLong_AsSsize_t(b);
+                PyList_Insert(target, i < 0 ? i + PyList_GET_SIZE(target) + 1 : i, prior);
+            } else {
+                PyObject_SetItem(target, b, prior);
+            }
+            break;
+        case STORE_ATTR:    // a.b = c
+            prior ? PyObject_SetAttr(target, b, prior) : PyObject_DelAttr(target, b);
+            break;
+        case DELETE_ATTR:   // del a.b
+            if(prior){
+                PyObject_SetAttr(target, b, prior);
+            }
+            break;
+        default:
+            // In place operation on a list, prior is its old length
+            if(prior && PyList_CheckExact(target)){
+                PyList_SetSlice(target, PyLong_AsSsize_t(prior), PY_SSIZE_T_MAX, NULL);
+            }
+    }
+    if(inline_key){
+        Py_DECREF(b);
+    }
+    if(PyErr_Occurred()){
+        PyErr_Clear();
+        return false;
+    }
+    return true;
+}
+
+static bool Recording_undo(ReplayState& state, MutationLog* mutations, size_t step){
+    // Undo the mutations after 'step' up to the state's step, latest first
+    std::vector<Mutation> undo;
+    Mutation mutation;
+    auto reader = mutations->seek(step + 1);
+    while(reader.next(mutation) && mutation.step <= state.step){
+        if(!mutation.prior.known){
+            return false;
+        }
+        undo.push_back(mutation);
+    }
+    for(auto it = undo.rbegin(); it != undo.rend(); ++it){
+        if(!Recording_undo_mutation(state, *it)){
+            return false;
+        }
+    }
+    return true;
+}
+
+ReplaySource Recording_replay(RecordingObject* recording, ReplayState& state, size_t step, MilestoneCache* cache){
+    // Bring the state's objects to 'step', returns where they were brought from. With a
+    // cache, states of other Milestones are kept in it and picked up again from there.
+    if(cache && state.milestone != Recording_milestone_at(recording, step)){
+        if(!cache->take(Recording_milestone_at(recording, step), state)){
+            cache->put(state, std::max<Py_ssize_t>(0, recording->cache_bytes));
+        }
+    }
+    auto plan = Recording_plan_replay(recording, state, step);
+    auto mutations = std::get<0>(recording->milestones[plan.milestone]);
+
+    if(plan.source == UNDO_FROM_CACHE){
+        if(Recording_undo(state, mutations, step)){
+            state.step = step;
+            return UNDO_FROM_CACHE;
+        }
+        plan.source = FROM_MILESTONE;   // Something couldn't be undone, the state needs reloading
+    }
+
+    auto reader = mutations->skip_reader();
+    if(plan.source == FROM_CACHE){
+        Recording_load_added(recording, state);     // Their mutations all come after state.step
+        reader = mutations->skip_seek(state.step + 1);
+    } else {
+        Recording_load_milestone(recording, state, plan.milestone);
+    }
+    // Runs are decoded without the GIL, then applied in a tight loop
+    std::vector<Mutation> run;
+    Mutation mutation;
+    do {
+        run.clear();
+        {
+            NativeSection native(recording);
+            while(run.size() < REPLAY_RUN && reader.next(mutation, step) && mutation.step <= step){
+                run.push_back(mutation);
+            }
+        }
+        for(auto& m : run){
+            Recording_replay_mutation(state, mutations, m);
+        }
+    } while(run.size() == REPLAY_RUN);
+    state.milestone = plan.milestone;
+    state.step = step;
+    return plan.source;
+}
+
+static ReplayState& Recording_slot(RecordingObject* recording, size_t step){
+    // The tail answers queries of the latest step and of steps it can replay forwards to,
+    // 'replay' the others, so looking back meanwhile doesn't undo the tail
+    auto& tail = recording->tail;
+    bool ahead = tail.milestone != NO_MILESTONE && tail.milestone == Recording_milestone_at(recording, step) && tail.step <= step;
+    return ahead || step + 1 == recording->lines.size() ? tail : recording->replay;
+}
+
+static bool Recording_atomic(PyObject* obj){
+    // Objects copy.deepcopy() returns as they are
+    auto type = Py_TYPE(obj);
+    return obj == Py_None || obj == Py_Ellipsis || obj == Py_NotImplemented || type == &PyLong_Type
+           || type == &PyUnicode_Type || type == &PyFloat_Type || type == &PyBool_Type || type == &PyBytes_Type
+           || type == &PyComplex_Type || type == &PyCode_Type || type == &PyFunction_Type
+           || type == &PyCFunction_Type || PyType_Check(obj);
+}
+
+static PyObject* Recording_deepcopy(PyObject* obj, PyObject* memo){
+    // copy.deepcopy(obj, memo), done natively for the builtin containers and atoms most
+    // values are made of. Shares memo with copy.deepcopy(), which copies everything else.
+    if(Recording_atomic(obj)){
+        Py_INCREF(obj);
+        return obj;
+    }
+    auto type = Py_TYPE(obj);
+    if(type != &PyList_Type && type != &PyDict_Type && type != &PyTuple_Type && type != &PySet_Type){
+        return PyObject_CallMethodObjArgs(copy_module, deepcopy_str, obj, memo, NULL);
+    }
+
+    auto id = PyLong_FromVoidPtr(obj);
+    auto clone = PyDict_GetItem(memo, id);
+    if(clone != NULL || Py_EnterRecursiveCall(" in deepcopy")){
+        Py_DECREF(id);
+        Py_XINCREF(clone);
+        return clone;
+    }
+    bool failed = false;
+    if(type == &PyTuple_Type){
+        // Only copied if an item is, like copy.deepcopy()
+        auto size = PyTuple_GET_SIZE(obj);
+        auto items = PyTuple_New(size);
+        bool copied = false;
+        for(Py_ssize_t i = 0; i < size && !failed; i++){
+            auto item = Recording_deepcopy(PyTuple_GET_ITEM(obj, i), memo);
+            failed = item == NULL;
+            copied |= item != PyTuple_GET_ITEM(obj, i);
+            PyTuple_SET_ITEM(items, i, item);
+        }
+        clone = failed ? NULL : PyDict_GetItem(memo, id);    // Copied by a cycle through it
+        if(clone != NULL || failed || !copied){
+            Py_DECREF(items);
+            items = failed ? NULL : clone ? clone : obj;
+            Py_XINCREF(items);
+        } else {
+            PyDict_SetItem(memo, id, items);
+        }
+        clone = items;
+    } else {
+        // Into the memo before the items, which may refer back to it
+        clone = type == &PyList_Type ? PyList_New(0) : type == &PyDict_Type ? PyDict_New() : PySet_New(NULL);
+        PyDict_SetItem(memo, id, clone);
+        if(type == &PyList_Type){
+            for(Py_ssize_t i = 0; i < PyList_GET_SIZE(obj) && !failed; i++){
+                auto item = PyList_GET_ITEM(obj, i);
+                Py_INCREF(item);    // Held in case a __deepcopy__ changes the list
+                auto item_clone = Recording_deepcopy(item, memo);
+                failed = item_clone == NULL || PyList_Append(clone, item_clone) != 0;
+                Py_DECREF(item); Py_XDECREF(item_clone);
+            }
+        } else if(type == &PyDict_Type){
+            PyObject *key, *value;
+            Py_ssize_t i = 0;
+            while(!failed && PyDict_Next(obj, &i, &key, &value)){
+                Py_INCREF(key); Py_INCREF(value);
+                auto key_clone = Recording_deepcopy(key, memo);
+                auto value_clone = key_clone ? Recording_deepcopy(value, memo) : NULL;
+                failed = value_clone == NULL || PyDict_SetItem(clone, key_clone, value_clone) != 0;
+                Py_DECREF(key); Py_DECREF(value);
+                Py_XDECREF(key_clone); Py_XDECREF(value_clone);
+            }
+        } else {
+            auto items = PyObject_GetIter(obj);
+            PyObject* item;
+            while(!failed && items && (item = PyIter_Next(items)) != NULL){
+                auto item_clone = Recording_deepcopy(item, memo);
+                failed = item_clone == NULL || PySet_Add(clone, item_clone) != 0;
+                Py_DECREF(item); Py_XDECREF(item_clone);
+            }
+            failed |= items == NULL || PyErr_Occurred() != NULL;
+            Py_XDECREF(items);
+        }
+        if(failed){
+            Py_CLEAR(clone);
+        }
+    }
+    Py_LeaveRecursiveCall();
+    Py_DECREF(id);
+    return clone;
+}
+
+static PyObject* Recording_clone(ReplayState& state, PyObject* obj, PyObject* memo){
+    // New reference to the value of obj that won't change when the state replays on
+    auto copy = state.copy_of(obj);
+    if(copy == NULL || memo == NULL){
+        obj = copy ? copy : obj;
+        Py_INCREF(obj);
+        return obj;
+    }
+    auto clone = Recording_deepcopy(copy, memo);
+    if(clone == NULL){
+        PyErr_Clear();      // e.g. holds something unpicklable, share it
+        Py_INCREF(copy);
+        return copy;
+    }
+    return clone;
+}
+
+void Recording_bind(ReplayState& state, const Mutation& binding, PyObject* dict, PyObject* memo){
+    // Apply a name binding to dict, values are cloned into memo unless it is NULL
+    switch(binding.opcode){
+        case STORE_FAST:
+        case STORE_NAME:
+        case STORE_GLOBAL: {
+            auto value = Recording_clone(state, binding.c, memo);
+            PyDict_SetItem(dict, binding.b, value);
+            Py_DECREF(value);
+            break;
+        }
+        default:
+            if(PyDict_DelItem(dict, binding.b) != 0){
+                PyErr_Clear();
+            }
+    }
+}
+
+static void Recording_frame_bindings(RecordingObject* recording, ReplayState& state, CallId call, size_t step,
+                                     PyObject* dict, PyObject* memo){
+    // Bind the names a call instance had bound at 'step' into dict, using the replayed objects
+    auto mutations = Recording_indexed(recording, state.milestone);
+    std::vector<Mutation> bound;
+    {
+        NativeSection native(recording);
+        MutationLog::BoundNames names;
+        mutations->names_at(call, step, names);
+        auto bindings = mutations->bindings_of(call);
+        bound.resize(names.size());
+        for(size_t i = 0; i < names.size(); i++){
+            mutations->decode((*bindings)[names[i].second], bound[i]);
+        }
+    }
+    for(auto& mutation : bound){
+        Recording_bind(state, mutation, dict, memo);
+    }
+}
+
+static PyObject* Recording_dicts(PyObject *self, PyObject *args){
+    // TODO: preserve state so that subsequent calls to step + 1 are fast?
+    PyObject* step_obj;
+    if (PyArg_UnpackTuple(args, "dicts", 1, 1, &step_obj)) {
+        DEBUG_TIME("START");
+
+        auto n = PyLong_AsLong(step_obj);
+        if(PyErr_Occurred()){
+            // Probably gave something that isn't an integer as argument
+            return NULL;
+        }
+
+        RecordingObject* recording = (RecordingObject*)self;
+        size_t step;
+        if(!Recording_clamp_step(recording, n, step)){
+            return NULL;
+        }
+        auto frame = recording->calls[step];
+        auto global_frame = recording->global_call;
+
+        // Replay object mutations up to 'step' so objects are in the correct state (baby VM!)
+        QueryReplay replay(recording, Recording_slot(recording, step));
+        Recording_replay(recording, replay.state, step, &recording->cache);
+
+        DEBUG_TIME("MINI VM");
+
+        // Then only the names bound by the module level and the frame at 'step'. The
+        // values are cloned, later queries replay on from the same objects.
+        auto memo = PyDict_New();
+        auto globals = PyDict_New();
+        auto locals = PyDict_New();
+        Recording_frame_bindings(recording, replay.state, global_frame, step, globals, memo);
+        if(frame != global_frame){
+            Recording_frame_bindings(recording, replay.state, frame, step, locals, memo);
+        }
+        Py_DECREF(memo);
+
+        return Py_BuildValue("NN", globals, locals);   // state is now as it was on requested step
+    }
+    return NULL;
+}
+
+/*
+    Partial states. The state of a few names only needs the objects their
+    values reach: the dumps of those objects in the snapshot (with the dumps
+    they are linked to), and of whatever mutations up to the step store
+    into them. Both are found from the Milestone's indices without
+    unpickling anything, then only those dumps are loaded and only the
+    mutations of their objects replayed, into a state of its own.
+*/
+static bool Recording_load_dumps(RecordingObject* recording, ReplayState& state, size_t milestone, const std::vector<bool>& needed){
+    // Unpickle the needed dumps of a Milestone, false if one refers to a dump that isn't
+    PickleOrder* pickle_order; PyObject* pickle_bytes;
+    std::tie(std::ignore, pickle_order, pickle_bytes) = recording->milestones[milestone];
+
+    state.clear();
+    bool loaded = true;
+    auto bytes = PyObject_CallMethod(pickle_bytes, "getvalue", NULL);
+    auto bytesio = PyObject_CallMethodObjArgs(io_module, bytesio_str, bytes, NULL);
+    auto unpickler = Recording_unpickler(bytesio);
+    for(size_t dump = 0; dump < needed.size() && loaded; dump++){
+        if(needed[dump]){
+            auto position = PyObject_CallMethod(bytesio, "seek", "n", (Py_ssize_t)pickle_order->offset(dump));
+            auto obj = position ? PyObject_CallMethod(unpickler, "load", NULL) : NULL;
+            if(obj == NULL){
+                PyErr_Clear();
+                loaded = false;
+            } else {
+                state.objects[(*pickle_order)[dump]] = obj;
+            }
+            Py_XDECREF(position);
+        }
+    }
+    Py_DECREF(unpickler); Py_DECREF(bytesio); Py_DECREF(bytes);
+    state.milestone = milestone;
+    return loaded;
+}
+
+static void Recording_load_reachable(RecordingObject* recording, ReplayState& state, size_t milestone,
+                                     const std::vector<PyObject*>& roots, size_t step){
+    // Load the objects reachable from roots up to 'step', or all of them if that fails
+    MutationLog* mutations; PickleOrder* pickle_order;
+    std::tie(mutations, pickle_order, std::ignore) = recording->milestones[milestone];
+
+    // The dumps the roots need, and those of objects later stored into them
+    std::vector<bool> needed(pickle_order->size());
+    size_t added = 0;
+    for(auto root : roots){
+        added += pickle_order->close(pickle_order->dump_of(root), needed);
+    }
+    Mutation mutation;
+    if(added != 0){         // Nothing can be stored into consts, so only when a root has a dump
+        NativeSection native(recording);
+        while(added != 0){
+            added = 0;
+            auto reader = mutations->reader();
+            while(reader.next(mutation) && mutation.step <= step){
+                auto target = pickle_order->dump_of(mutation.a);
+                if(target != PickleOrder::NONE && needed[target]){
+                    added += pickle_order->close(pickle_order->dump_of(mutation.b), needed)
+                           + pickle_order->close(pickle_order->dump_of(mutation.c), needed);
+                }
+            }
+        }
+    }
+    if(!Recording_load_dumps(recording, state, milestone, needed)){
+        Recording_load_milestone(recording, state, milestone);
+    }
+    state.milestone = milestone;
+    state.step = mutations->first_step();
+}
+
+// A name of the state at some step and the recorded object bound to it
+struct BoundName {
+    PyObject*   name;
+    PyObject*   value;
+};
+
+static void Recording_bound(RecordingObject* recording, size_t step, std::vector<BoundName>& state){
+    // The names state(step) has, in the same order, with the recorded objects bound to them. Found
+    // from the bindings alone without replaying anything, or the GIL once they are indexed.
+    auto mutations = Recording_indexed(recording, Recording_milestone_at(recording, step));
+    NativeSection native(recording);
+    auto frame = recording->calls[step];
+    phmap::flat_hash_map<PyObject*, size_t> globals_at;
+    std::vector<BoundName> locals;
+    for(auto bound : {&state, &locals}){
+        auto call = bound == &state ? recording->global_call : frame;
+        if(bound == &locals && frame == recording->global_call){
+            continue;
+        }
+        MutationLog::BoundNames names;
+        mutations->names_at(call, step, names);
+        auto bindings = mutations->bindings_of(call);
+        Mutation binding;
+        for(auto& name : names){
+            mutations->decode((*bindings)[name.second], binding);
+            if(bound == &state){
+                globals_at[name.first] = state.size();
+            }
+            bound->push_back({binding.b, binding.c});
+        }
+    }
+    for(auto& local : locals){
+        auto it = globals_at.find(local.name);
+        if(it != globals_at.end()){
+            state[it->second].value = local.value;   // Overwrite globals with locals
+        } else {
+            state.push_back(local);
+        }
+    }
+}
+
+static void Recording_bind_values(ReplayState& state, const std::vector<BoundName>& values, PyObject* dict,
+                                  ObjectMap* clones = NULL){
+    // Set the values of the names in dict, cloned from the replayed objects. 'clones' (recorded object
+    // -> clone) are reused for the objects they have, and get the clones made now added.
+    auto memo = PyDict_New();   // Shared, so objects bound to several names stay the same object
+    if(clones){
+        for(auto& item : *clones){
+            auto copy = state.copy_of(item.first);
+            if(copy){
+                auto id = PyLong_FromVoidPtr(copy);
+                PyDict_SetItem(memo, id, item.second);
+                Py_DECREF(id);
+            }
+        }
+    }
+    for(auto& bound : values){
+        auto value = Recording_clone(state, bound.value, memo);
+        PyDict_SetItem(dict, bound.name, value);
+        Py_DECREF(value);
+    }
+    if(clones){
+        for(auto& item : state.objects){
+            auto id = PyLong_FromVoidPtr(item.second);
+            auto clone = PyDict_GetItem(memo, id);
+            Py_DECREF(id);
+            if(clone && !clones->contains(item.first)){
+                Py_INCREF(clone);
+                (*clones)[item.first] = clone;
+            }
+        }
+    }
+    Py_DECREF(memo);
+}
+
+static void Recording_partial_values(RecordingObject* recording, const std::vector<size_t>& steps,
+                                     const std::vector<std::vector<BoundName>>& values, const std::vector<PyObject*>& dicts,
+                                     ObjectMap* clones = NULL){
+    // Set values[i] into dicts[i] as they were at steps[i] (ascending, in one Milestone), loading and
+    // replaying only the objects the values reach
+    auto milestone = Recording_milestone_at(recording, steps.back());
+    auto mutations = std::get<0>(recording->milestones[milestone]);
+    std::vector<PyObject*> roots;
+    for(auto& step_values : values){
+        for(auto& bound : step_values){
+            roots.push_back(bound.value);
+        }
+    }
+
+    ReplayState state;
+    Recording_load_reachable(recording, state, milestone, roots, steps.back());
+    Mutation mutation;
+    auto reader = mutations->skip_reader();
+    bool more = !state.objects.empty() && reader.next(mutation, steps[0]);    // Only consts, nothing to replay
+    for(size_t i = 0; i < steps.size(); i++){
+        for(; more && mutation.step <= steps[i]; more = reader.next(mutation, steps[i])){
+            Recording_replay_mutation(state, mutations, mutation);     // Skips objects that weren't loaded
+        }
+        PyErr_Clear();
+        state.step = steps[i];
+        Recording_bind_values(state, values[i], dicts[i], clones);
+    }
+}
+
+static void Recording_select(std::vector<BoundName>& state, PyObject* names){
+    // Keep only the names in the set 'names'
+    state.erase(std::remove_if(state.begin(), state.end(), [names](const BoundName& b){
+        return PySet_Contains(names, b.name) != 1;
+    }), state.end());
+}
+
+PyObject* Recording_named_state(RecordingObject* recording, size_t step, PyObject* names, ObjectMap* clones){
+    // New dict of the given names at 'step', replaying only what their values need when the
+    // Milestone isn't replayed already. Objects in 'clones' come back as the clones made before.
+    std::vector<BoundName> values;
+    Recording_bound(recording, step, values);
+    Recording_select(values, names);
+    auto state = PyDict_New();
+    QueryReplay replay(recording, Recording_slot(recording, step));
+    if(replay.state.milestone != Recording_milestone_at(recording, step)){
+        Recording_partial_values(recording, {step}, {values}, {state}, clones);
+    } else {
+        Recording_replay(recording, replay.state, step, &recording->cache);
+        Recording_bind_values(replay.state, values, state, clones);
+    }
+    return state;
+}
+
+PyObject* Recording_bound_names(RecordingObject* recording, size_t step){
+    // New dict with the names state(step) has as keys (in the same order) and None values
+    std::vector<BoundName> state;
+    Recording_bound(recording, step, state);
+    auto names = PyDict_New();
+    for(auto& bound : state){
+        PyDict_SetItem(names, bound.name, Py_None);
+    }
+    return names;
+}
+
+/*
+    Mutations inside values. What an object contains is followed through the
+    links of its Milestone's pickle order, from the object to the objects it
+    held when dumped, and on to the objects stored into any of them since,
+    reading the Milestone's object mutations forwards. An object taken out of
+    a value again stays reached, so a later mutation of it still counts as
+    one of the value.
+*/
+static void Recording_inner_mutations(RecordingObject* recording, size_t milestone, const std::vector<PyObject*>& roots,
+                                      size_t start, size_t stop, std::vector<std::vector<size_t>>& steps){
+    // Steps in [start, stop) at which each of roots, or anything it contained, was mutated, ascending
+    MutationLog* mutations; PickleOrder* pickle_order;
+    std::tie(mutations, pickle_order, std::ignore) = recording->milestones[milestone];
+    steps.assign(roots.size(), {});
+    NativeSection native(recording);
+
+    // Dumps each root reached, and the roots each reached object belongs to
+    std::vector<phmap::flat_hash_set<uint32_t>> reached(roots.size());
+    phmap::flat_hash_map<PyObject*, std::vector<uint32_t>> owners;
+    std::vector<uint32_t> added;
+    auto reach = [&](uint32_t root, uint32_t dump){
+        added.clear();
+        pickle_order->contents(dump, reached[root], added);
+        for(auto d : added){
+            owners[(*pickle_order)[d]].push_back(root);
+        }
+    };
+    for(uint32_t r = 0; r < roots.size(); r++){
+        auto dump = pickle_order->dump_of(roots[r]);
+        if(dump == PickleOrder::NONE){
+            owners[roots[r]].push_back(r);      // Only the object itself (e.g. a const)
+        } else {
+            reach(r, dump);
+        }
+    }
+
+    Mutation mutation;
+    auto reader = mutations->reader();
+    while(reader.next(mutation) && mutation.step < stop){
+        auto it = owners.find(mutation.a);
+        if(it == owners.end()){
+            continue;
+        }
+        auto mutated = it->second;      // Copied, reaching more objects adds to owners
+        for(auto r : mutated){
+            if(mutation.step >= start && (steps[r].empty() || steps[r].back() != mutation.step)){
+                steps[r].push_back(mutation.step);
+            }
+            for(auto value : {mutation.b, mutation.c}){
+                auto dump = pickle_order->dump_of(value);
+                if(dump != PickleOrder::NONE){
+                    reach(r, dump);
+                }
+            }
+        }
+    }
+}
+
+/*
+    Differences between two steps. Which object each name is bound to at
+    either step comes from the bindings. A name that stayed bound to the
+    same object changed if that object, or anything it contains, was
+    mutated in between, so only the values of the names that changed are
+    replayed.
+*/
+static void Recording_mutated(RecordingObject* recording, const std::vector<PyObject*>& objects, size_t start, size_t stop,
+                              std::vector<bool>& mutated){
+    // Whether each object or anything it contains was mutated in steps (start, stop]
+    mutated.assign(objects.size(), false);
+    for(auto m = Recording_milestone_at(recording, start); m <= Recording_milestone_at(recording, stop); m++){
+        auto mutations = std::get<0>(recording->milestones[m]);
+        if(mutations->count_until(stop) == mutations->count_until(start)){
+            continue;   // Nothing at all was mutated in between
+        }
+        std::vector<std::vector<size_t>> steps;
+        Recording_inner_mutations(recording, m, objects, start + 1, stop + 1, steps);
+        for(size_t i = 0; i < objects.size(); i++){
+            mutated[i] = mutated[i] || !steps[i].empty();
+        }
+    }
+}
+
+static PyObject* Recording_diff(PyObject *self, PyObject *args){
+    PyObject *start_obj, *stop_obj;
+    if(!PyArg_UnpackTuple(args, "diff", 2, 2, &start_obj, &stop_obj)){
+        return NULL;
+    }
+    auto recording = (RecordingObject*)self;
+    auto n1 = PyLong_AsLong(start_obj);
+    auto n2 = PyLong_AsLong(stop_obj);
+    if(PyErr_Occurred()){
+        return NULL;
+    }
+    size_t step1, step2;
+    if(!Recording_clamp_step(recording, n1, step1) || !Recording_clamp_step(recording, n2, step2)){
+        return NULL;
+    }
+    n1 = (long)step1;
+    n2 = (long)step2;
+
+    std::vector<BoundName> before, after;
+    Recording_bound(recording, n1, before);
+    Recording_bound(recording, n2, after);
+    phmap::flat_hash_map<PyObject*, PyObject*> before_values;
+    for(auto& bound : before){
+        before_values[bound.name] = bound.value;
+    }
+
+    // Names bound to another object, or to one mutated in between (inside or itself), and names only one step has
+    auto changed = PySet_New(NULL);
+    std::vector<PyObject*> kept_names, kept_values;
+    for(auto& bound : after){
+        auto it = before_values.find(bound.name);
+        if(it == before_values.end() || it->second != bound.value){
+            PySet_Add(changed, bound.name);
+        } else {
+            kept_names.push_back(bound.name);
+            kept_values.push_back(bound.value);
+        }
+        if(it != before_values.end()){
+            before_values.erase(it);
+        }
+    }
+    for(auto& item : before_values){
+        PySet_Add(changed, item.first);
+    }
+    std::vector<bool> mutated;
+    Recording_mutated(recording, kept_values, std::min(n1, n2), std::max(n1, n2), mutated);
+    for(size_t i = 0; i < kept_names.size(); i++){
+        if(mutated[i]){
+            PySet_Add(changed, kept_names[i]);
+        }
+    }
+    Recording_select(before, changed);
+    Recording_select(after, changed);
+    Py_DECREF(changed);
+
+    // Both steps from one partial replay when they share a Milestone that isn't replayed already
+    auto before_state = PyDict_New();
+    auto after_state = PyDict_New();
+    auto milestone = Recording_milestone_at(recording, n1);
+    QueryReplay replay(recording);
+    if(milestone == Recording_milestone_at(recording, n2) && replay.state.milestone != milestone){
+        if(n1 <= n2){
+            Recording_partial_values(recording, {(size_t)n1, (size_t)n2}, {before, after}, {before_state, after_state});
+        } else {
+            Recording_partial_values(recording, {(size_t)n2, (size_t)n1}, {after, before}, {after_state, before_state});
+        }
+    } else {
+        for(auto side : {std::make_tuple(n1, &before, before_state), std::make_tuple(n2, &after, after_state)}){
+            size_t step = std::get<0>(side);
+            if(replay.state.milestone != Recording_milestone_at(recording, step)){
+                Recording_partial_values(recording, {step}, {*std::get<1>(side)}, {std::get<2>(side)});
+            } else {
+                Recording_replay(recording, replay.state, step, &recording->cache);
+                Recording_bind_values(replay.state, *std::get<1>(side), std::get<2>(side));
+            }
+        }
+    }
+    return Py_BuildValue("NN", before_state, after_state);
+}
+
+static PyObject* Recording_state(PyObject *self, PyObject *args, PyObject *kwds){
+    PyObject* step_obj;
+    PyObject* names_obj = Py_None;
+    int lazy = 0;
+    char *keywords[] = {"", "names", "lazy", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|Op:state", keywords, &step_obj, &names_obj, &lazy)){
+        return NULL;
+    }
+    auto recording = (RecordingObject*)self;
+    if(names_obj != Py_None || lazy){
+        PyObject* names = NULL;
+        if(names_obj != Py_None){
+            names = PySet_New(names_obj);
+            if(names == NULL){
+                return NULL;
+            }
+        }
+        auto n = PyLong_AsLong(step_obj);
+        size_t step;
+        if(PyErr_Occurred() || !Recording_clamp_step(recording, n, step)){
+            Py_XDECREF(names);
+            return NULL;
+        }
+
+        auto state = lazy ? StateMapping_New(recording, step, names) : Recording_named_state(recording, step, names);
+        Py_XDECREF(names);
+        return state;
+    }
+
+    auto dicts_args = PyTuple_Pack(1, step_obj);
+    auto globals_locals = Recording_dicts(self, dicts_args);
+    Py_DECREF(dicts_args);
+    if(globals_locals == NULL){
+        return NULL;
+    } else {
+        PyObject* state = PyTuple_GetItem(globals_locals, 0);
+        PyDict_Update(state, PyTuple_GetItem(globals_locals, 1));   // Overwrite globals with locals
+        Py_INCREF(state);
+        Py_DECREF(globals_locals);
+        return state;
+    }
+}
+
+static PyObject* Recording_state_now(PyObject *self, PyObject *args, PyObject *kwds){
+    // state() of the latest step, answered from the tail so only steps since the last call replay
+    auto recording = (RecordingObject*)self;
+    auto step = PyLong_FromSsize_t((Py_ssize_t)recording->lines.size() - 1);
+    auto head = PyTuple_Pack(1, step);
+    auto state_args = PySequence_Concat(head, args);
+    auto state = state_args ? Recording_state(self, state_args, kwds) : NULL;
+    Py_XDECREF(state_args); Py_DECREF(head); Py_DECREF(step);
+    return state;
+}
+
+/*
+    Batches of states. Steps are answered in ascending order, so each
+    Milestone costs one load and one forward replay however many of its
+    steps are asked for. Bindings are followed the same way: each call keeps
+    the position of the last binding of every name, and a state decodes one
+    binding per name rather than every binding its frames made.
+*/
+struct CallNames {
+    PyObject*   names;      // Name -> index in bindings_of(call) of its last binding
+    size_t      next;       // Index of the first binding not applied yet
+};
+using BatchNames = phmap::flat_hash_map<CallId, CallNames>;
+
+static void Recording_batch_bind(MutationLog* mutations, CallId call, size_t step, BatchNames& batch, PyObject* dict,
+                                 ReplayState& state, PyObject* names_filter, PyObject* memo){
+    // Bind the names 'call' had bound at 'step' into dict, catching its bindings up first
+    auto bindings = mutations->bindings_of(call);
+    if(bindings == NULL){
+        return;
+    }
+    auto it = batch.find(call);
+    if(it == batch.end()){
+        it = batch.insert({call, {PyDict_New(), 0}}).first;
+    }
+    auto& names = it->second;
+    Mutation binding;
+    for(; names.next < bindings->size() && (*bindings)[names.next].step <= step; names.next++){
+        // Kept in the same order as binding the values would leave them
+        mutations->decode((*bindings)[names.next], binding);
+        if(binding.opcode == STORE_FAST || binding.opcode == STORE_NAME || binding.opcode == STORE_GLOBAL){
+            auto index = PyLong_FromSize_t(names.next);
+            PyDict_SetItem(names.names, binding.b, index);
+            Py_DECREF(index);
+        } else if(PyDict_DelItem(names.names, binding.b) != 0){
+            PyErr_Clear();
+        }
+    }
+    // Decoded first, binding runs Python code and another thread may grow the index meanwhile
+    std::vector<Mutation> bound;
+    PyObject *name, *index;
+    Py_ssize_t i = 0;
+    while(PyDict_Next(names.names, &i, &name, &index)){
+        if(names_filter != NULL && !PySet_Contains(names_filter, name)){
+            continue;
+        }
+        bound.emplace_back();
+        mutations->decode((*bindings)[PyLong_AsSize_t(index)], bound.back());
+    }
+    for(auto& mutation : bound){
+        Recording_bind(state, mutation, dict, memo);
+    }
+}
+
+using StateRequest = std::pair<size_t, Py_ssize_t>;     // (step, position in the result)
+
+static void Recording_batch(RecordingObject* recording, const std::vector<StateRequest>& requests, PyObject* names,
+                            PyObject* result){
+    // Set the state of each request (ascending steps) in the result list
+    BatchNames batch;
+    size_t milestone = NO_MILESTONE;
+    QueryReplay replay(recording);
+    for(auto& request : requests){
+        auto step = request.first;
+        if(Recording_milestone_at(recording, step) != milestone){
+            for(auto& item : batch){
+                Py_DECREF(item.second.names);
+            }
+            batch.clear();      // Bindings are indexed per Milestone
+            milestone = Recording_milestone_at(recording, step);
+        }
+        Recording_replay(recording, replay.state, step, &recording->cache);
+
+        auto mutations = Recording_indexed(recording, milestone);
+        auto frame = recording->calls[step];
+        auto memo = PyDict_New();
+        auto state = PyDict_New();
+        Recording_batch_bind(mutations, recording->global_call, step, batch, state, replay.state, names, memo);
+        if(frame != recording->global_call){
+            auto locals = PyDict_New();
+            Recording_batch_bind(mutations, frame, step, batch, locals, replay.state, names, memo);
+            PyDict_Update(state, locals);   // Overwrite globals with locals
+            Py_DECREF(locals);
+        }
+        Py_DECREF(memo);
+        PyList_SET_ITEM(result, request.second, state);
+    }
+    for(auto& item : batch){
+        Py_DECREF(item.second.names);
+    }
+}
+
+#ifndef _WIN32
+/*
+    Batches split over worker processes. Each worker is forked, so it starts
+    with the whole recording - columns, mutation logs and snapshots - shared
+    copy-on-write with no export step, and answers the Milestones it is given
+    on its own core. States come back pickled through a pipe.
+
+    Values without a replayed copy (consts: functions, numbers...) are live
+    objects the parent keeps in its consts dict, at the same address as in
+    the worker, so they are sent by address rather than by value. Modules
+    aren't consts (their contents aren't tracked) and can't be pickled, they
+    are sent by name and found in sys.modules. Whatever a worker can't send
+    is answered in the parent afterwards.
+*/
+static PyObject* Recording_persistent_id(PyObject* capsule, PyObject* obj){
+    auto consts = (ObjectSet*)PyCapsule_GetPointer(capsule, NULL);
+    if(consts->find(obj) != consts->end()){
+        return PyLong_FromVoidPtr(obj);
+    }
+    if(PyModule_CheckExact(obj)){
+        auto name = PyModule_GetNameObject(obj);
+        auto module = name ? PyImport_GetModule(name) : NULL;
+        Py_XDECREF(module);
+        if(module == obj){
+            return name;
+        }
+        Py_XDECREF(name);
+        PyErr_Clear();
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef persistent_id_def = {"persistent_id", (PyCFunction)Recording_persistent_id, METH_O, NULL};
+
+static PyObject* Recording_pickle_states(RecordingObject* recording, PyObject* states){
+    // Bytes of the pickled list of states, states that can't be pickled are replaced by None
+    ObjectSet consts;
+    PyObject *key, *value;
+    Py_ssize_t i = 0;
+    while(PyDict_Next(recording->consts, &i, &key, &value)){
+        consts.insert(value);
+    }
+    auto capsule = PyCapsule_New(&consts, NULL, NULL);
+    auto persistent_id = PyCFunction_New(&persistent_id_def, capsule);
+    Py_DECREF(capsule);
+
+    PyObject* bytes = NULL;
+    for(int attempt = 0; attempt < 2 && bytes == NULL; attempt++){
+        if(attempt == 1){
+            // Find the states that fail on their own
+            for(Py_ssize_t s = 0; s < PyList_GET_SIZE(states); s++){
+                auto single = PyList_New(1);
+                Py_INCREF(PyList_GET_ITEM(states, s));
+                PyList_SET_ITEM(single, 0, PyList_GET_ITEM(states, s));
+                auto retry = Recording_pickle_states(recording, single);
+                if(retry == NULL){
+                    Py_INCREF(Py_None);
+                    PyList_SetItem(states, s, Py_None);
+                }
+                Py_XDECREF(retry);
+                Py_DECREF(single);
+            }
+        }
+        auto bytesio = PyObject_CallMethodObjArgs(io_module, bytesio_str, NULL);
+        auto pickler = PyObject_CallMethod(pickle_module, "Pickler", "Oi", bytesio, -1);
+        PyObject_SetAttrString(pickler, "persistent_id", persistent_id);
+        auto done = PyObject_CallMethodObjArgs(pickler, dump_str, states, NULL);
+        if(done != NULL){
+            bytes = PyObject_CallMethod(bytesio, "getvalue", NULL);
+            Py_DECREF(done);
+        } else {
+            PyErr_Clear();
+        }
+        Py_DECREF(pickler); Py_DECREF(bytesio);
+        if(PyList_GET_SIZE(states) == 1){
+            break;      // Already a single state
+        }
+    }
+    Py_DECREF(persistent_id);
+    return bytes;
+}
+
+static void Recording_fork_batch(RecordingObject* recording, const std::vector<StateRequest>& requests, PyObject* names,
+                                 long processes, PyObject* result){
+    // Set the results of as many requests as the workers manage to answer
+
+    // Give whole Milestones to the least loaded worker, longest replays first
+    std::vector<std::pair<size_t, std::pair<size_t, size_t>>> groups;   // (replay length, [begin, end) of requests)
+    for(size_t begin = 0, end; begin < requests.size(); begin = end){
+        auto milestone = Recording_milestone_at(recording, requests[begin].first);
+        for(end = begin; end < requests.size() && Recording_milestone_at(recording, requests[end].first) == milestone; end++);
+        groups.push_back({requests[end - 1].first - recording->milestone_steps[milestone] + 1, {begin, end}});
+    }
+    std::sort(groups.rbegin(), groups.rend());
+    std::vector<std::vector<StateRequest>> work(std::min((size_t)processes, groups.size()));
+    std::vector<size_t> load(work.size(), 0);
+    for(auto& group : groups){
+        auto w = std::min_element(load.begin(), load.end()) - load.begin();
+        load[w] += group.first;
+        work[w].insert(work[w].end(), requests.begin() + group.second.first, requests.begin() + group.second.second);
+    }
+
+    // Other threads' queries may be in a native phase, holding the lock. The workers would never see it
+    // released, so fork once they are out, and keep new ones out until all the workers are forked.
+    std::unique_lock<std::shared_timed_mutex> forking(recording->lock);
+    std::vector<std::pair<pid_t, int>> workers;
+    for(auto& part : work){
+        std::sort(part.begin(), part.end());
+        int fds[2];
+        if(pipe(fds) != 0){
+            break;
+        }
+        PyOS_BeforeFork();
+        auto pid = fork();
+        if(pid == 0){
+            PyOS_AfterFork_Child();
+            forking.release();      // Owned by the parent's thread, the worker's has another id
+            new (&recording->lock) std::shared_timed_mutex();
+            close(fds[0]);
+            auto states = PyList_New(part.size());
+            std::vector<StateRequest> local;
+            for(size_t i = 0; i < part.size(); i++){
+                local.push_back({part[i].first, (Py_ssize_t)i});
+            }
+            Recording_batch(recording, local, names, states);
+            auto bytes = Recording_pickle_states(recording, states);
+            if(bytes == NULL){
+                _exit(1);
+            }
+            auto data = PyBytes_AS_STRING(bytes);
+            auto left = PyBytes_GET_SIZE(bytes);
+            while(left > 0){
+                auto written = write(fds[1], data, left);
+                if(written <= 0){
+                    _exit(1);
+                }
+                data += written; left -= written;
+            }
+            _exit(0);
+        }
+        PyOS_AfterFork_Parent();
+        close(fds[1]);
+        if(pid < 0){
+            close(fds[0]);
+            break;
+        }
+        workers.push_back({pid, fds[0]});
+    }
+    forking.unlock();
+
+    for(size_t w = 0; w < workers.size(); w++){
+        std::string data;
+        char buffer[1 << 16];
+        ssize_t got;
+        while((got = read(workers[w].second, buffer, sizeof(buffer))) != 0){
+            if(got < 0 && errno != EINTR){
+                break;
+            }
+            data.append(buffer, std::max(got, (ssize_t)0));
+        }
+        close(workers[w].second);
+        int status;
+        while(waitpid(workers[w].first, &status, 0) < 0 && errno == EINTR);
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+            continue;
+        }
+
+        auto bytes = PyBytes_FromStringAndSize(data.data(), data.size());
+        auto bytesio = PyObject_CallMethodObjArgs(io_module, bytesio_str, bytes, NULL);
+        auto unpickler = Recording_unpickler(bytesio);
+        auto states = PyObject_CallMethod(unpickler, "load", NULL);
+        if(states != NULL && PyList_Check(states) && PyList_GET_SIZE(states) == (Py_ssize_t)work[w].size()){
+            for(size_t i = 0; i < work[w].size(); i++){
+                auto state = PyList_GET_ITEM(states, i);
+                if(state != Py_None){
+                    Py_INCREF(state);
+                    PyList_SET_ITEM(result, work[w][i].second, state);
+                }
+            }
+        }
+        PyErr_Clear();
+        Py_XDECREF(states); Py_DECREF(unpickler); Py_DECREF(bytesio); Py_DECREF(bytes);
+    }
+}
+#endif
+
+static PyObject* Recording_states(PyObject *self, PyObject *args, PyObject *kwds){
+    PyObject* steps_obj;
+    PyObject* names_obj = Py_None;
+    long processes = 1;
+    char *keywords[] = {"", "names", "processes", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|Ol:states", keywords, &steps_obj, &names_obj, &processes)){
+        return NULL;
+    }
+    auto recording = (RecordingObject*)self;
+    auto steps_seq = PySequence_Fast(steps_obj, "steps must be iterable");
+    if(steps_seq == NULL){
+        return NULL;
+    }
+    auto count = PySequence_Fast_GET_SIZE(steps_seq);
+    std::vector<StateRequest> requests;
+    for(Py_ssize_t i = 0; i < count; i++){
+        auto n = PyLong_AsLong(PySequence_Fast_GET_ITEM(steps_seq, i));
+        if(PyErr_Occurred()){
+            Py_DECREF(steps_seq);
+            return NULL;
+        }
+        size_t step;
+        if(!Recording_clamp_step(recording, n, step)){
+            Py_DECREF(steps_seq);
+            return NULL;
+        }
+        requests.push_back({step, i});
+    }
+    Py_DECREF(steps_seq);
+    std::sort(requests.begin(), requests.end());
+    PyObject* names = NULL;
+    if(names_obj != Py_None){
+        names = PySet_New(names_obj);
+        if(names == NULL){
+            return NULL;
+        }
+    }
+
+    auto result = PyList_New(count);
+#ifndef _WIN32
+    if(processes > 1 && !requests.empty()){
+        Recording_fork_batch(recording, requests, names, processes, result);
+        std::vector<StateRequest> missing;
+        for(auto& request : requests){
+            if(PyList_GET_ITEM(result, request.second) == NULL){
+                missing.push_back(request);
+            }
+        }
+        requests.swap(missing);
+    }
+#endif
+    Recording_batch(recording, requests, names, result);
+    Py_XDECREF(names);
+    return result;
+}
+
+/*
+    History of a name. A name changes when a call instance binds it (other
+    than the bindings that snapshot the frames at the start of each
+    Milestone) and when the object it is bound to, or anything that object
+    contains, is mutated while bound. A Milestone's bindings are indexed by
+    name the first time one is asked for, and the mutations inside its
+    objects are found as for diff().
+*/
+struct Change {
+    size_t      step;
+    PyObject*   value;      // The name's object after the change, NULL once it is deleted
+};
+
+static void Recording_changes(RecordingObject* recording, size_t milestone, PyObject* name,
+                              size_t start, size_t stop, std::vector<Change>& changes){
+    // Append the changes of a name in [start, stop) that a Milestone recorded, in step order
+    auto mutations = Recording_indexed(recording, milestone);
+    auto bindings = mutations->bindings_named(name);
+    if(bindings == NULL){
+        return;
+    }
+    bool last = milestone + 1 == recording->milestones.size();
+    size_t end = last ? recording->lines.size() : recording->milestone_steps[milestone + 1];
+    size_t first = changes.size();
+
+    // Objects are the name's until its call binds it again or returns
+    struct Bound {
+        PyObject*   value;
+        size_t      from;
+        size_t      until;
+    };
+    std::vector<Bound> periods;
+    phmap::flat_hash_map<CallId, size_t> bound;     // Period of each call's current binding
+    auto unbind = [&](CallId call, size_t until){
+        auto it = bound.find(call);
+        if(it != bound.end()){
+            auto exit = recording->call_records[call].exit;
+            auto& period = periods[it->second];
+            period.until = std::min(std::min(until, stop), exit == NO_STEP ? end : exit + 1);
+        }
+    };
+
+    Mutation binding;
+    for(auto& entry : *bindings){
+        if(entry.step >= stop){
+            break;
+        }
+        mutations->decode(entry, binding);
+        unbind(binding.call, entry.step);
+        bool deleted = binding.opcode == DELETE_FAST || binding.opcode == DELETE_NAME || binding.opcode == DELETE_GLOBAL;
+        auto value = deleted ? NULL : binding.c;
+        bool snapshot = binding.prior.known && binding.prior.value == value
+                        && recording->call_records[binding.call].enter < entry.step;
+        if(!snapshot && entry.step >= start){
+            changes.push_back({entry.step, value});
+        }
+        bound[binding.call] = periods.size();
+        periods.push_back({value, entry.step, end});
+    }
+    for(auto& item : bound){
+        unbind(item.first, end);
+    }
+
+    // Mutations inside each object while it was bound
+    std::vector<PyObject*> roots;
+    phmap::flat_hash_map<PyObject*, size_t> root_of;
+    for(auto& period : periods){
+        if(period.value != NULL && !root_of.count(period.value)){
+            root_of[period.value] = roots.size();
+            roots.push_back(period.value);
+        }
+    }
+    std::vector<std::vector<size_t>> steps;
+    Recording_inner_mutations(recording, milestone, roots, start, stop, steps);
+    for(auto& period : periods){
+        if(period.value == NULL){
+            continue;
+        }
+        auto& mutated = steps[root_of[period.value]];
+        auto it = std::upper_bound(mutated.begin(), mutated.end(), period.from);
+        for(; it != mutated.end() && *it < period.until; ++it){
+            changes.push_back({*it, period.value});
+        }
+    }
+
+    // One change per step, the last
+    std::stable_sort(changes.begin() + first, changes.end(), [](const Change& x, const Change& y){
+        return x.step < y.step;
+    });
+    size_t kept = first;
+    for(size_t i = first; i < changes.size(); i++){
+        if(i + 1 == changes.size() || changes[i + 1].step != changes[i].step){
+            changes[kept++] = changes[i];
+        }
+    }
+    changes.resize(kept);
+}
+
+static bool Recording_name_range(RecordingObject* recording, PyObject* args, const char* method,
+                                 PyObject*& name, size_t& start, size_t& stop){
+    // Arguments of history() and series(), name is NULL if it was never bound
+    PyObject *name_obj, *start_obj = NULL, *stop_obj = NULL;
+    if(!PyArg_UnpackTuple(args, method, 1, 3, &name_obj, &start_obj, &stop_obj)){
+        return false;
+    }
+    if(!PyUnicode_Check(name_obj)){
+        PyErr_SetString(PyExc_TypeError, "name must be a str");
+        return false;
+    }
+    start = 0;
+    stop = recording->lines.size();
+    if(!Recording_step_range(start_obj, stop_obj, start, stop)){
+        return false;
+    }
+    stop = std::min(stop, recording->lines.size());
+    name = PyDict_GetItem(recording->consts, name_obj);     // Names are saved as consts
+    return true;
+}
+
+static PyObject* Recording_history(PyObject *self, PyObject *args){
+    auto recording = (RecordingObject*)self;
+    PyObject* name; size_t start, stop;
+    if(!Recording_name_range(recording, args, "history", name, start, stop)){
+        return NULL;
+    }
+    std::vector<Change> changes;
+    if(name != NULL && start < stop){
+        for(auto m = Recording_milestone_at(recording, start); m <= Recording_milestone_at(recording, stop - 1); m++){
+            Recording_changes(recording, m, name, start, stop, changes);
+        }
+    }
+    auto result = PyList_New(changes.size());
+    for(size_t i = 0; i < changes.size(); i++){
+        PyList_SET_ITEM(result, i, PyLong_FromSize_t(changes[i].step));
+    }
+    return result;
+}
+
+static PyObject* Recording_series(PyObject *self, PyObject *args){
+    auto recording = (RecordingObject*)self;
+    PyObject* name; size_t start, stop;
+    if(!Recording_name_range(recording, args, "series", name, start, stop)){
+        return NULL;
+    }
+    auto result = PyList_New(0);
+    if(name == NULL || start >= stop){
+        return result;
+    }
+    for(auto m = Recording_milestone_at(recording, start); m <= Recording_milestone_at(recording, stop - 1); m++){
+        std::vector<Change> changes;
+        Recording_changes(recording, m, name, start, stop, changes);
+        if(changes.empty()){
+            continue;
+        }
+
+        // One replay of the objects the name was bound to, cloned at each change
+        std::vector<PyObject*> roots;
+        for(auto& change : changes){
+            roots.push_back(change.value);
+        }
+        ReplayState state;
+        Recording_load_reachable(recording, state, m, roots, changes.back().step);
+        auto reader = std::get<0>(recording->milestones[m])->skip_reader();
+        Mutation mutation;
+        bool more = reader.next(mutation, changes[0].step);
+        for(auto& change : changes){
+            for(; more && mutation.step <= change.step; more = reader.next(mutation, change.step)){
+                Recording_replay_mutation(state, std::get<0>(recording->milestones[m]), mutation);
+            }
+            PyErr_Clear();
+            auto memo = PyDict_New();
+            auto value = change.value ? Recording_clone(state, change.value, memo) : (Py_INCREF(Py_None), Py_None);
+            auto point = Py_BuildValue("nN", (Py_ssize_t)change.step, value);
+            PyList_Append(result, point);
+            Py_DECREF(point); Py_DECREF(memo);
+        }
+    }
+    return result;
+}
+
+/*
+    Watchpoints. A name alone changes as in history(). A path into its value
+    (X[3], X.attr[0]...) is evaluated on one partial replay per Milestone,
+    again only at the steps where the name is bound or an object on the path
+    is mutated. Consts compare by value, as a snapshot holds its own copies
+    of them, replayed objects by identity and whether they were mutated.
+
+    find() assumes the predicate keeps holding once it does ("when did this
+    become wrong"): it gallops forward from n0 and then bisects, so it looks
+    at about twice the log of the distance states, each a lazy mapping that
+    only replays the names the predicate reads.
+*/
+using Accessor = std::pair<bool, PyObject*>;    // (is an attribute, name or key)
+
+static bool Recording_parse_target(PyObject* target, PyObject*& name, std::vector<Accessor>& path){
+    // Split "X[3].y" into the name X and its accessors, keys are Python literals
+    if(!PyUnicode_Check(target)){
+        PyErr_SetString(PyExc_TypeError, "target must be a str");
+        return false;
+    }
+    std::string text = PyUnicode_AsUTF8(target);
+    auto end = text.find_first_of("[.");
+    name = PyUnicode_FromString(text.substr(0, end).c_str());
+    while(end != std::string::npos && end < text.size()){
+        if(text[end] == '.'){
+            auto next = text.find_first_of("[.", end + 1);
+            path.push_back({true, PyUnicode_FromString(text.substr(end + 1, next - end - 1).c_str())});
+            end = next;
+            continue;
+        }
+        // Closing bracket of the key, skipping over brackets inside it and in quotes
+        size_t close = end + 1;
+        int depth = 0;
+        char quote = 0;
+        for(; close < text.size(); close++){
+            auto c = text[close];
+            if(quote){
+                if(c == '\\'){
+                    close++;
+                } else if(c == quote){
+                    quote = 0;
+                }
+            } else if(c == '\'' || c == '"'){
+                quote = c;
+            } else if(c == '[' || c == '(' || c == '{'){
+                depth++;
+            } else if(c == ']' || c == ')' || c == '}'){
+                if(depth-- == 0){
+                    break;
+                }
+            }
+        }
+        PyObject* key = NULL;
+        if(close < text.size()){
+            auto ast = PyImport_ImportModule("ast");
+            key = ast ? PyObject_CallMethod(ast, "literal_eval", "s", text.substr(end + 1, close - end - 1).c_str()) : NULL;
+            Py_XDECREF(ast);
+        }
+        if(key == NULL){
+            PyErr_Clear();
+            PyErr_Format(PyExc_ValueError, "target '%s' must be a name followed by [literal] and .attribute", text.c_str());
+            return false;
+        }
+        path.push_back({false, key});
+        end = close + 1;
+    }
+    return true;
+}
+
+static PyObject* Recording_follow(ReplayState& state, PyObject* obj, const std::vector<Accessor>& path, ObjectSet& copies){
+    // New reference to the end of path from the replayed value of obj, NULL if it doesn't reach.
+    // The replayed objects on the way are added to copies.
+    obj = obj ? state.value(obj) : NULL;
+    Py_XINCREF(obj);
+    for(auto& accessor : path){
+        if(obj == NULL){
+            break;
+        }
+        copies.insert(obj);
+        auto next = accessor.first ? PyObject_GetAttr(obj, accessor.second) : PyObject_GetItem(obj, accessor.second);
+        Py_DECREF(obj);
+        obj = next;
+    }
+    PyErr_Clear();
+    return obj;
+}
+
+static void Recording_path_changes(RecordingObject* recording, size_t milestone, PyObject* name,
+                                   const std::vector<Accessor>& path, size_t start, size_t stop, bool first_only,
+                                   std::vector<size_t>& steps){
+    // Append the steps in [start, stop) where the value at the end of path from name changed
+    auto mutations = Recording_indexed(recording, milestone);
+    auto bindings = mutations->bindings_named(name);
+    if(bindings == NULL){
+        return;     // Never bound in this Milestone
+    }
+    struct Bound {
+        size_t      step;
+        PyObject*   value;      // NULL once deleted
+        bool        snapshot;   // Rebinds what was bound as the Milestone started
+    };
+    std::vector<Bound> bound;
+    std::vector<PyObject*> roots;
+    Mutation binding;
+    for(auto& entry : *bindings){
+        if(entry.step >= stop){
+            break;
+        }
+        mutations->decode(entry, binding);
+        bool deleted = binding.opcode == DELETE_FAST || binding.opcode == DELETE_NAME || binding.opcode == DELETE_GLOBAL;
+        auto value = deleted ? NULL : binding.c;
+        bool snapshot = binding.prior.known && binding.prior.value == value
+                        && recording->call_records[binding.call].enter < entry.step;
+        bound.push_back({entry.step, value, snapshot});
+        roots.push_back(value);
+    }
+    if(bound.empty()){
+        return;
+    }
+
+    ReplayState state;
+    Recording_load_reachable(recording, state, milestone, roots, stop - 1);
+    ObjectSet copies;
+    for(auto& item : state.objects){
+        copies.insert(item.second);
+    }
+    auto differs = [&](PyObject* old, PyObject* now, bool mutated){
+        if(old == NULL || now == NULL){
+            return old != now;
+        }
+        if(old == now){
+            return mutated;
+        }
+        if(copies.count(old) || copies.count(now) || Py_TYPE(old) != Py_TYPE(now)){
+            return true;
+        }
+        auto equal = PyObject_RichCompareBool(old, now, Py_EQ);
+        PyErr_Clear();
+        return equal != 1;
+    };
+
+    PyObject* current = NULL;       // Recorded object bound to the name
+    PyObject* element = NULL;       // Value at the end of the path, owned
+    ObjectSet on_path;
+    Mutation mutation;
+    auto reader = mutations->reader();
+    bool more = reader.next(mutation);
+    size_t b = 0;
+    while(b < bound.size() || (more && mutation.step < stop)){
+        auto step = b < bound.size() ? bound[b].step : stop;
+        if(more && mutation.step < step){
+            step = mutation.step;
+        }
+        bool touched = false, mutated = false, snapshot = b < bound.size() && bound[b].step == step;
+        for(; more && mutation.step == step; more = reader.next(mutation)){
+            auto target = state.copy_at(mutations, mutation.ref_a);
+            touched = touched || (target && on_path.count(target));
+            mutated = mutated || (target && target == element);
+            Recording_replay_mutation(state, mutations, mutation);
+        }
+        PyErr_Clear();
+        for(; b < bound.size() && bound[b].step == step; b++){
+            current = bound[b].value;
+            snapshot = snapshot && bound[b].snapshot;
+            touched = true;
+        }
+        if(!touched){
+            continue;
+        }
+        on_path.clear();
+        auto now = Recording_follow(state, current, path, on_path);
+        if(now != NULL){
+            on_path.insert(now);
+        }
+        bool changed = differs(element, now, mutated);
+        Py_XDECREF(element);
+        element = now;
+        if(changed && !snapshot && step >= start){
+            steps.push_back(step);
+            if(first_only){
+                break;
+            }
+        }
+    }
+    Py_XDECREF(element);
+}
+
+static PyObject* Recording_find_change(PyObject *self, PyObject *args, PyObject *kwds){
+    PyObject *target, *after_obj = Py_None, *before_obj = Py_None;
+    char *keywords[] = {"", "after", "before", NULL};
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO:find_change", keywords, &target, &after_obj, &before_obj)){
+        return NULL;
+    }
+    auto recording = (RecordingObject*)self;
+    size_t start = 0, stop = recording->lines.size();
+    if(after_obj != Py_None){
+        auto after = PyLong_AsLong(after_obj);
+        start = (size_t)std::max(0L, after + 1);
+    }
+    if(before_obj != Py_None){
+        auto before = PyLong_AsLong(before_obj);
+        stop = std::min(stop, (size_t)std::max(0L, before));
+    }
+    if(PyErr_Occurred()){
+        return NULL;
+    }
+
+    PyObject* name_str = NULL;
+    std::vector<Accessor> path;
+    bool parsed = Recording_parse_target(target, name_str, path);
+    auto name = parsed ? PyDict_GetItem(recording->consts, name_str) : NULL;     // Names are saved as consts
+    Py_XDECREF(name_str);
+    size_t found = NO_STEP;
+    if(name != NULL && start < stop){
+        // Forwards from 'after' unless only 'before' was given
+        bool forwards = after_obj != Py_None || before_obj == Py_None;
+        auto first = Recording_milestone_at(recording, start), last = Recording_milestone_at(recording, stop - 1);
+        for(size_t i = 0; i <= last - first && found == NO_STEP; i++){
+            auto m = forwards ? first + i : last - i;
+            std::vector<size_t> steps;
+            if(path.empty()){
+                std::vector<Change> changes;
+                Recording_changes(recording, m, name, start, stop, changes);
+                for(auto& change : changes){
+                    steps.push_back(change.step);
+                }
+            } else {
+                Recording_path_changes(recording, m, name, path, start, stop, forwards, steps);
+            }
+            if(!steps.empty()){
+                found = forwards ? steps.front() : steps.back();
+            }
+        }
+    }
+    for(auto& accessor : path){
+        Py_DECREF(accessor.second);
+    }
+    if(!parsed){
+        return NULL;
+    }
+    if(found == NO_STEP){
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromSize_t(found);
+}
+
+static int Recording_holds(RecordingObject* recording, PyObject* predicate, size_t step){
+    // predicate(state at step) as 1 or 0, -1 if it raised
+    auto state = StateMapping_New(recording, step, NULL);
+    auto result = PyObject_CallFunctionObjArgs(predicate, state, NULL);
+    Py_DECREF(state);
+    if(result == NULL){
+        return -1;
+    }
+    auto holds = PyObject_IsTrue(result);
+    Py_DECREF(result);
+    return holds;
+}
+
+static PyObject* Recording_find(PyObject *self, PyObject *args){
+    PyObject *start_obj, *stop_obj, *predicate;
+    if(!PyArg_UnpackTuple(args, "find", 3, 3, &start_obj, &stop_obj, &predicate)){
+        return NULL;
+    }
+    auto recording = (RecordingObject*)self;
+    size_t start = 0, stop = recording->lines.size();
+    if(!Recording_step_range(start_obj, stop_obj, start, stop)){
+        return NULL;
+    }
+    stop = std::min(stop, recording->lines.size());
+    if(start >= stop){
+        Py_RETURN_NONE;
+    }
+
+    // Gallop until it holds, then bisect (false, true]
+    auto holds = Recording_holds(recording, predicate, start);
+    if(holds != 0){
+        return holds < 0 ? NULL : PyLong_FromSize_t(start);
+    }
+    size_t low = start, high = start, distance = 1;
+    while(true){
+        high = std::min(start + distance, stop - 1);
+        holds = Recording_holds(recording, predicate, high);
+        if(holds < 0){
+            return NULL;
+        }
+        if(holds){
+            break;
+        }
+        if(high == stop - 1){
+            Py_RETURN_NONE;
+        }
+        low = high;
+        distance *= 2;
+    }
+    while(high - low > 1){
+        auto middle = low + (high - low) / 2;
+        holds = Recording_holds(recording, predicate, middle);
+        if(holds < 0){
+            return NULL;
+        }
+        (holds ? high : low) = middle;
+    }
+    return PyLong_FromSize_t(high);
+}
+
+static PyObject* Recording_cursor(PyObject *self, PyObject *args){
+    if (PyArg_UnpackTuple(args, "cursor", 0, 0)) {
+        return Cursor_New((RecordingObject*)self);
+    }
+    return NULL;
+}
+
+static PyObject* Recording_steps(PyObject *self, PyObject *args){
+    if (PyArg_UnpackTuple(args, "steps", 0, 0)) {
+        RecordingObject* recording = (RecordingObject*)self;
+        return PyLong_FromLong((long)recording->lines.size());
+    }
+    return NULL;
+}
+
+static PyObject* Recording_line(PyObject *self, PyObject *args){
+    PyObject *n_obj, *line_number = NULL; 
+    if (PyArg_UnpackTuple(args, "line", 1, 1, &n_obj)) {
+        line_number = PyLong_FromLong(0);
+        if(PyNumber_Check(n_obj)){
+            RecordingObject* recording = (RecordingObject*)self;
+            auto n = PyLong_AsLong(n_obj);
+            if(0 <= n && n < recording->lines.size()){
+                auto line = recording->lines[n];
+                Py_DECREF(line_number);
+                line_number = PyLong_FromLong(line);
+            }
+        }
+    }
+    return line_number;
+}
+
+static PyObject* Recording_offset(PyObject *self, PyObject *args){
+    PyObject *n_obj;
+    if (PyArg_UnpackTuple(args, "offset", 1, 1, &n_obj)) {
+        RecordingObject* recording = (RecordingObject*)self;
+        auto n = PyLong_AsLong(n_obj);
+        if(PyErr_Occurred()){
+            return NULL;
+        }
+        if(0 <= n && (size_t)n < recording->offsets.size() && recording->offsets[n] != NO_OFFSET){
+            return PyLong_FromLong(recording->offsets[n]);
+        }
+        Py_RETURN_NONE;     // Line level step, or recorded at line granularity
+    }
+    return NULL;
+}
+
+static PyObject* Recording_visits(PyObject *self, PyObject *args){
+    PyObject *l_obj, *start_obj = NULL, *stop_obj = NULL;
+    if (PyArg_UnpackTuple(args, "visits", 1, 3, &l_obj, &start_obj, &stop_obj)) {
+        auto line_num = PyLong_AsLong(l_obj);
+        if(PyErr_Occurred()){
+            return NULL;
+        }
+        auto recording = (RecordingObject*)self;
+        if(start_obj == NULL){
+            return VisitsView_New(recording, line_num);    // Lazy view over the posting list
+        }
+
+        // Only the steps in [start, stop)
+        size_t start = 0, stop = (size_t)-1;
+        if(!Recording_step_range(start_obj, stop_obj, start, stop)){
+            return NULL;
+        }
+        auto result = PyList_New(0);
+        if(0 < line_num && line_num <= (long)recording->visits.size()){
+            auto& list = recording->visits[line_num - 1];
+            list.each(list.lower_bound(start), list.lower_bound(stop), [&](size_t step){
+                auto py_step = PyLong_FromSize_t(step);
+                PyList_Append(result, py_step);
+                Py_DECREF(py_step);
+            });
+        }
+        return result;
+    }
+    return NULL;
+}
+
+static PyObject* Recording_count(PyObject *self, PyObject *args){
+    PyObject *l_obj, *start_obj = NULL, *stop_obj = NULL;
+    if (PyArg_UnpackTuple(args, "count", 1, 3, &l_obj, &start_obj, &stop_obj)) {
+        auto line_num = PyLong_AsLong(l_obj);
+        size_t start = 0, stop = (size_t)-1;
+        if(PyErr_Occurred() || !Recording_step_range(start_obj, stop_obj, start, stop)){
+            return NULL;
+        }
+        auto recording = (RecordingObject*)self;
+        size_t count = 0;
+        if(0 < line_num && line_num <= (long)recording->visits.size()){
+            count = recording->visits[line_num - 1].count(start, stop);
+        }
+        return PyLong_FromSize_t(count);
+    }
+    return NULL;
 }
 
-static void Recording_dealloc(RecordingObject *self){
-    Py_DECREF(self->pickler);
-    Py_DECREF(self->code);
-    Py_DECREF(self->visits);
-    Py_DECREF(self->consts);
-    MutationList* mutations; PickleOrder* pickle_order; PyObject* pickle_bytes;
-    for(auto& milestone : self->milestones){
-        std::tie(mutations, pickle_order, pickle_bytes) = milestone;
-        delete mutations;
-        delete pickle_order;
-        Py_DECREF(pickle_bytes);
+static bool Recording_check_timing(RecordingObject* recording){
+    if(!recording->timing){
+        PyErr_SetString(PyExc_ValueError, "Recording has no timestamps, record it with exec(..., timing=True)");
+        return false;
     }
-    self->pickle_order = NULL;
-    std::vector<Step>().swap(self->steps);
-    std::vector<Milestone>().swap(self->milestones);
-    Py_TYPE(self)->tp_free((PyObject *) self);
+    return true;
 }
 
-static void inplace_opcode(int opcode, ObjectMap& objects, PyObject* a, PyObject* b){
-    PyObject* obj = objects[b];
-    obj = obj ? obj : b;
+static PyObject* Recording_time(PyObject *self, PyObject *args){
+    PyObject *n_obj;
+    if (PyArg_UnpackTuple(args, "time", 1, 1, &n_obj)) {
+        auto recording = (RecordingObject*)self;
+        auto n = PyLong_AsLong(n_obj);
+        if(PyErr_Occurred() || !Recording_check_timing(recording)){
+            return NULL;
+        }
+        n = std::min((long)recording->times.size() - 1, std::max(0L, n));
+        return PyFloat_FromDouble(recording->times[n] * 1e-9);
+    }
+    return NULL;
+}
 
-    switch(opcode){
-        case INPLACE_POWER:
-            objects[a] = PyNumber_InPlacePower(objects[a], obj, Py_None);
-            break;
-        case INPLACE_MULTIPLY:
-            objects[a] = PyNumber_InPlaceMultiply(objects[a], obj);
-            break;
-        case INPLACE_MATRIX_MULTIPLY:
-            objects[a] = PyNumber_InPlaceMatrixMultiply(objects[a], obj);
-            break;
-        case INPLACE_TRUE_DIVIDE:
-            objects[a] = PyNumber_InPlaceTrueDivide(objects[a], obj);
-            break;
-        case INPLACE_FLOOR_DIVIDE:
-            objects[a] = PyNumber_InPlaceFloorDivide(objects[a], obj);
-            break;
-        case INPLACE_MODULO:
-            objects[a] = PyNumber_InPlaceRemainder(objects[a], obj);
-            break;
-        case INPLACE_ADD:
-            // TODO: unicode stuff
-            //printf("INPLACE_ADD %p %p\n", a, b);
-            objects[a] = PyNumber_InPlaceAdd(objects[a], obj);
-            break;
-        case INPLACE_SUBTRACT:
-            objects[a] = PyNumber_InPlaceSubtract(objects[a], obj);
-            break;
-        case INPLACE_LSHIFT:
-            objects[a] = PyNumber_InPlaceLshift(objects[a], obj);
-            break;
-        case INPLACE_RSHIFT:
-            objects[a] = PyNumber_InPlaceRshift(objects[a], obj);
-            break;
-        case INPLACE_AND:
-            objects[a] = PyNumber_InPlaceAnd(objects[a], obj);
-            break;
-        case INPLACE_XOR:
-            objects[a] = PyNumber_InPlaceXor(objects[a], obj);
-            break;
-        case INPLACE_OR:
-            objects[a] = PyNumber_InPlaceOr(objects[a], obj);
-            break;
-        default:
-            printf("UNKNOWN OPCODE %d\n", opcode);
+static PyObject* Recording_step_at_time(PyObject *self, PyObject *args){
+    PyObject *t_obj;
+    if (PyArg_UnpackTuple(args, "step_at_time", 1, 1, &t_obj)) {
+        auto recording = (RecordingObject*)self;
+        auto t = PyFloat_AsDouble(t_obj);
+        if(PyErr_Occurred() || !Recording_check_timing(recording)){
+            return NULL;
+        }
+        return PyLong_FromSize_t(recording->times.step_at(t > 0 ? (uint64_t)(t * 1e9) : 0));
     }
+    return NULL;
 }
 
-static PyObject* Recording_dicts(PyObject *self, PyObject *args){
-    // TODO: preserve state so that subsequent calls to step + 1 are fast?
-    PyObject* step_obj;
-    if (PyArg_UnpackTuple(args, "dicts", 1, 1, &step_obj)) {
-        DEBUG_TIME("START");
+struct ProfileStats {
+    size_t      count = 0;      // Line visits, or calls
+    uint64_t    self = 0;
+    uint64_t    inclusive = 0;
+    size_t      active = 0;     // Open periods, so recursion isn't counted twice in inclusive time
+};
 
-        int step = PyLong_AsLong(step_obj);
-        if(PyErr_Occurred()){
-            // Probably gave something that isn't an integer as argument
+static PyObject* Recording_profile(PyObject *self, PyObject *args){
+    if (PyArg_UnpackTuple(args, "profile", 0, 0)) {
+        auto recording = (RecordingObject*)self;
+        if(!Recording_check_timing(recording)){
             return NULL;
         }
 
-        RecordingObject* recording = (RecordingObject*)self;
-        step = std::min((int)recording->steps.size() - 1, std::max(0, step));
-        auto frame = (PyObject*)std::get<2>(recording->steps[step]);
-
-        // Find the relevant Milestone
-        MutationList* mutations = NULL; PickleOrder* pickle_order; PyObject* pickle_bytes;
-        std::tie(mutations, pickle_order, pickle_bytes) = recording->milestones[0];
-        for(auto& milestone : recording->milestones){
-            auto milestone_mutations = std::get<0>(milestone);
-            if(milestone_mutations->size() == 0){
-                break;
-            } else {
-                auto first_mutation = milestone_mutations->at(0);
-                if(std::get<0>(first_mutation) <= step){
-                    std::tie(mutations, pickle_order, pickle_bytes) = milestone;
-                } else {
-                    break;
-                }
+        // Walk the steps keeping a stack of active calls, each with the line it is on.
+        // A step's self time lasts until the next step, a line's inclusive time lasts
+        // until the next step in the same call, so it includes the calls it made.
+        struct Active { CallId call; int line; uint64_t since; uint64_t entered; };
+        std::vector<Active> stack;
+        phmap::flat_hash_map<CallId, size_t> depth_of;      // Position of each active call in stack
+        phmap::flat_hash_map<int, ProfileStats> lines;
+        phmap::flat_hash_map<PyObject*, ProfileStats> functions;
+        bool returning = false;
+        int last_line = 0; PyObject* last_code = NULL; uint64_t last_time = 0;
+
+        auto close_line = [&](Active& active, uint64_t t){
+            auto& stats = lines[active.line];
+            if(--stats.active == 0){
+                stats.inclusive += t - active.since;
             }
-        }
+        };
+        auto pop = [&](uint64_t t){
+            auto& active = stack.back();
+            close_line(active, t);
+            auto& stats = functions[recording->call_records[active.call].code];
+            if(--stats.active == 0){
+                stats.inclusive += t - active.entered;
+            }
+            depth_of.erase(active.call);
+            stack.pop_back();
+        };
 
-        DEBUG_TIME("MUTATION");
+        // Lines and calls are decoded a block at a time alongside the times,
+        // rather than looked up one step at a time
+        const size_t BLOCK = 4096;
+        std::vector<int> block_lines(BLOCK);
+        std::vector<CallId> block_calls(BLOCK);
+        auto steps = recording->times.size();
+        for(size_t from = 0; from < steps; from += BLOCK){
+            auto to = std::min(from + BLOCK, steps);
+            recording->lines.each(from, to, [&](size_t i, int line){ block_lines[i - from] = line; });
+            recording->calls.each(from, to, [&](size_t i, CallId call){ block_calls[i - from] = call; });
 
-        // Replay mutations up to 'step' so objects are in the correct state (baby VM!)
-        auto locals = PyDict_New();
-        auto globals = PyDict_New();
+            recording->times.each(from, to, [&](size_t i, uint64_t t){
+                int line = block_lines[i - from];
+                auto call = block_calls[i - from];
+                auto event = recording->events[i];
+                auto code = recording->call_records[call].code;
 
-        // Unpickle objects to their state at start of Milestone
-        auto bytes = PyObject_CallMethod(pickle_bytes, "getvalue", NULL);               // bytes = pickle_bytes.getvalue()
-        auto bytesio = PyObject_CallMethodObjArgs(io_module, bytesio_str, bytes, NULL); // bytes_io = io.BytesIO(bytes)
-        auto unpickler = PyObject_CallMethodObjArgs(pickle_module, unpickler_str, bytesio, NULL);
-        
-        DEBUG_TIME("CONSTRUCT");
-        
-        // Set object map to state at the start of the milestone
-        for(auto& obj_id : *pickle_order){
-            recording->objects[obj_id] = PyObject_CallMethod(unpickler, "load", NULL);
-        }
-
-        DEBUG_TIME("UNPICKLE");
-
-        size_t s; unsigned char op; PyObject *a, *b, *c, *obj;
-        for(auto& mutation : *mutations){
-            std::tie(s, op, a, b, c) = mutation;
-            if(s <= step){
-                //TODO: think about whether this is definitely safe to drop...
-                //b = Recording_check_const(recording, b);
-                switch(op){
-                    case STORE_ATTR:    // a.b = c
-                        PyObject_SetAttr(recording->objects[a], b, c);
-                        break;
-                    case STORE_SUBSCR:  // a[b] = c
-                        PyObject_SetItem(recording->objects[a], b, c);
-                        break;
-
-                    case STORE_FAST:    // b = c
-                    case STORE_NAME:    
-                        if(a == recording->global_frame){
-                    case STORE_GLOBAL:
-                            obj = recording->objects[c];
-                            PyDict_SetItem(globals, b, obj ? obj : c);
-                        } else if(a == frame){
-                            obj = recording->objects[c];
-                            PyDict_SetItem(locals, b, obj ? obj : c);
-                        }
-                        break;
-
-                    case DELETE_ATTR:   // del a.b
-                        PyObject_DelAttr(recording->objects[a], b);
-                        break;
-                    case DELETE_SUBSCR: // del a[b]
-                        PyObject_DelItem(recording->objects[a], b);
-                        break;
-
-                    case DELETE_FAST:   // del b
-                    case DELETE_NAME:
-                        if(a == recording->global_frame){
-                    case DELETE_GLOBAL:
-                            PyDict_DelItem(globals, b);
-                        } else if(a == frame){
-                            PyDict_DelItem(locals, b);
-                        }
-                        break;
-
-                    default:
-                        inplace_opcode(op, recording->objects, a, b);
+                if(i > 0){
+                    lines[last_line].self += t - last_time;
+                    functions[last_code].self += t - last_time;
                 }
-            } else {
-                break;
-            }
+                if(returning){
+                    pop(t);
+                    returning = false;
+                }
+
+                bool in_stack = !stack.empty() && (stack.back().call == call || depth_of.count(call));
+                if(event != PyTrace_CALL && in_stack){
+                    while(stack.back().call != call){
+                        pop(t);     // Calls that ended without a return event
+                    }
+                    close_line(stack.back(), t);
+                    stack.back().line = line;
+                    stack.back().since = t;
+                } else {
+                    depth_of[call] = stack.size();
+                    stack.push_back({call, line, t, t});
+                    auto& stats = functions[code];
+                    stats.count++;
+                    stats.active++;
+                }
+                lines[line].active++;
+
+                bool instruction = i < recording->offsets.size() && recording->offsets[i] != NO_OFFSET;
+                if(event == PyTrace_LINE && !instruction){
+                    lines[line].count++;
+                }
+                returning = event == PyTrace_RETURN;
+                last_line = line; last_code = code; last_time = t;
+            });
+        }
+        while(!stack.empty()){
+            pop(last_time);
         }
 
-        // TEMP TEMP TEMP /////////////
-        if(PyErr_Occurred()){
-            PyErr_Print();
+        auto stats_tuple = [](ProfileStats& stats){
+            return Py_BuildValue("(ndd)", (Py_ssize_t)stats.count, stats.self * 1e-9, stats.inclusive * 1e-9);
+        };
+        auto line_dict = PyDict_New();
+        for(auto& item : lines){
+            auto key = PyLong_FromLong(item.first);
+            auto value = stats_tuple(item.second);
+            PyDict_SetItem(line_dict, key, value);
+            Py_DECREF(key); Py_DECREF(value);
         }
+        auto function_dict = PyDict_New();
+        for(auto& item : functions){
+            auto code = (PyCodeObject*)item.first;
+            auto key = Py_BuildValue("(Oi)", code->co_name, code->co_firstlineno);
+            auto value = stats_tuple(item.second);
+            PyDict_SetItem(function_dict, key, value);
+            Py_DECREF(key); Py_DECREF(value);
+        }
+        return Py_BuildValue("{sNsN}", "lines", line_dict, "functions", function_dict);
+    }
+    return NULL;
+}
 
-        DEBUG_TIME("MINI VM");
+// ==== Call tree navigation ====================
 
-        return Py_BuildValue("NN", globals, locals);   // state is now as it was on requested step
+static bool Recording_nav_step(PyObject *args, const char* name, RecordingObject* recording, size_t& n){
+    PyObject *n_obj;
+    if(!PyArg_UnpackTuple(args, name, 1, 1, &n_obj)){
+        return false;
     }
-    return NULL;
+    auto value = PyLong_AsLong(n_obj);
+    if(PyErr_Occurred()){
+        return false;
+    }
+    if(value < 0 || (size_t)value >= recording->lines.size()){
+        PyErr_SetString(PyExc_IndexError, "step out of range");
+        return false;
+    }
+    n = (size_t)value;
+    return true;
 }
 
-static PyObject* Recording_state(PyObject *self, PyObject *args){
-    auto globals_locals = Recording_dicts(self, args);
-    if(globals_locals == NULL){
+static PyObject* step_or_none(RecordingObject* recording, size_t step){
+    if(step == NO_STEP || step >= recording->lines.size()){
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromSize_t(step);
+}
+
+static size_t Recording_skip_callees(RecordingObject* self, size_t n, uint32_t depth){
+    // First step from n on that is not inside a call made at 'depth'
+    auto m = self->depths.next_at_most(n, depth);
+    return m == self->depths.NONE ? NO_STEP : m;    // A callee never returned
+}
+
+static PyObject* Recording_next_in_frame(PyObject *self, PyObject *args){
+    auto recording = (RecordingObject*)self;
+    size_t n;
+    if(!Recording_nav_step(args, "next_in_frame", recording, n)){
         return NULL;
-    } else {
-        PyObject* state = PyTuple_GetItem(globals_locals, 0);
-        PyDict_Update(state, PyTuple_GetItem(globals_locals, 1));   // Overwrite globals with locals
-        return state;
     }
+    auto call = recording->calls[n];
+    auto m = Recording_skip_callees(recording, n + 1, recording->depths[n]);
+    if(m != NO_STEP && m < recording->lines.size() && recording->calls[m] == call){
+        return PyLong_FromSize_t(m);
+    }
+    Py_RETURN_NONE;     // The frame returned
 }
 
-static PyObject* Recording_steps(PyObject *self, PyObject *args){
-    if (PyArg_UnpackTuple(args, "steps", 0, 0)) {
-        RecordingObject* recording = (RecordingObject*)self;
-        return PyLong_FromLong((long)recording->steps.size());
+static PyObject* Recording_step_over(PyObject *self, PyObject *args){
+    auto recording = (RecordingObject*)self;
+    size_t n;
+    if(!Recording_nav_step(args, "step_over", recording, n)){
+        return NULL;
     }
-    return NULL;
+    return step_or_none(recording, Recording_skip_callees(recording, n + 1, recording->depths[n]));
 }
 
-static PyObject* Recording_line(PyObject *self, PyObject *args){
-    PyObject *n_obj, *line_number = NULL; 
-    if (PyArg_UnpackTuple(args, "line", 1, 1, &n_obj)) {
-        line_number = PyLong_FromLong(0);
-        if(PyNumber_Check(n_obj)){
-            RecordingObject* recording = (RecordingObject*)self;
-            auto n = PyLong_AsLong(n_obj);
-            if(0 <= n && n < recording->steps.size()){
-                auto step = recording->steps[n];
-                auto line = std::get<0>(step);
-                Py_DECREF(line_number);
-                line_number = PyLong_FromLong(line);
-            }
+static PyObject* Recording_step_out(PyObject *self, PyObject *args){
+    auto recording = (RecordingObject*)self;
+    size_t n;
+    if(!Recording_nav_step(args, "step_out", recording, n)){
+        return NULL;
+    }
+    auto exit = recording->call_records[recording->calls[n]].exit;
+    return step_or_none(recording, exit == NO_STEP ? NO_STEP : exit + 1);
+}
+
+static size_t Recording_prev_at_depth(RecordingObject* self, size_t n, uint32_t depth){
+    // Last step before n that is not inside a call made at 'depth'
+    auto m = self->depths.prev_at_most(n, depth);
+    return m == self->depths.NONE ? NO_STEP : m;
+}
+
+static PyObject* Recording_step_back(PyObject *self, PyObject *args){
+    auto recording = (RecordingObject*)self;
+    size_t n;
+    if(!Recording_nav_step(args, "step_back", recording, n)){
+        return NULL;
+    }
+    return step_or_none(recording, Recording_prev_at_depth(recording, n, recording->depths[n]));
+}
+
+static PyObject* Recording_prev_call(PyObject *self, PyObject *args){
+    auto recording = (RecordingObject*)self;
+    size_t n;
+    if(!Recording_nav_step(args, "prev_call", recording, n)){
+        return NULL;
+    }
+    // Latest call of the same function that was entered before step n
+    auto call = recording->calls[n];
+    auto found = recording->function_calls.find(recording->call_records[call].code);
+    if(found == recording->function_calls.end()){
+        Py_RETURN_NONE;
+    }
+    auto& calls = found->second;
+    auto it = std::lower_bound(calls.begin(), calls.end(), n, [&](CallId c, size_t step){
+        return recording->call_records[c].enter < step;
+    });
+    while(it != calls.begin()){
+        --it;
+        if(*it != call){
+            return PyLong_FromSize_t(recording->call_records[*it].enter);
         }
     }
-    return line_number;
+    Py_RETURN_NONE;
 }
 
-static PyObject* Recording_visits(PyObject *self, PyObject *args){
-    PyObject* l_obj;
-    if (PyArg_UnpackTuple(args, "visits", 1, 1, &l_obj)) {
-        auto line_num = PyLong_AsLong(l_obj);
+static PyObject* Recording_stack(PyObject *self, PyObject *args){
+    auto recording = (RecordingObject*)self;
+    size_t n;
+    if(!Recording_nav_step(args, "stack", recording, n)){
+        return NULL;
+    }
+
+    // Active calls, innermost first, with the step each one is on. A caller is
+    // on the last step it ran before entering the call below it.
+    std::vector<std::pair<CallId, size_t>> frames;
+    auto call = recording->calls[n];
+    size_t at = n;
+    while(call != NO_CALL && at != NO_STEP){
+        frames.push_back({call, at});
+        auto& record = recording->call_records[call];
+        if(record.parent != NO_CALL){
+            at = Recording_prev_at_depth(recording, record.enter, recording->call_records[record.parent].depth);
+        }
+        call = record.parent;
+    }
+
+    QueryReplay replay(recording, Recording_slot(recording, n));
+    Recording_replay(recording, replay.state, n, &recording->cache);
+    auto memo = PyDict_New();   // Shared, so objects seen from several frames stay the same object
+
+    auto stack = PyList_New(frames.size());
+    Py_ssize_t i = frames.size();
+    for(auto& frame : frames){
+        auto code = (PyCodeObject*)recording->call_records[frame.first].code;
+        auto locals = PyDict_New();     // The module level's locals are its globals
+        Recording_frame_bindings(recording, replay.state, frame.first, n, locals, memo);
+        PyList_SET_ITEM(stack, --i, Py_BuildValue("{sOsisN}",
+            "name", code->co_name, "line", recording->lines[frame.second], "locals", locals));
+    }
+    Py_DECREF(memo);
+    return stack;     // Outermost frame first
+}
+
+static PyObject* Recording_call_counts(PyObject *self, PyObject *args){
+    if (PyArg_UnpackTuple(args, "call_counts", 0, 0)) {
         auto recording = (RecordingObject*)self;
-        if(line_num <= 0 || line_num > PyList_Size(recording->visits)){
-            return PyList_New(0);
-        } else {
-            auto visit_list = PyList_GetItem(recording->visits, PyLong_AsSsize_t(l_obj) - 1);
-            Py_INCREF(visit_list);
-            return visit_list;
+        auto counts = PyDict_New();
+        for(auto& item : recording->function_calls){
+            auto code = (PyCodeObject*)item.first;
+            auto key = Py_BuildValue("(Oi)", code->co_name, code->co_firstlineno);
+            auto value = PyLong_FromSize_t(item.second.size());
+            PyDict_SetItem(counts, key, value);
+            Py_DECREF(key); Py_DECREF(value);
         }
+        return counts;
     }
     return NULL;
 }
 
 static PyMemberDef Recording_members[] = {
     {"code", T_OBJECT_EX, offsetof(RecordingObject, code), 0, "Source code executed for this recording"},
+    {"cache_bytes", T_PYSSIZET, offsetof(RecordingObject, cache_bytes), 0, "Snapshot bytes of replayed Milestones to keep for later queries"},
+    {"running", T_BOOL, offsetof(RecordingObject, running), READONLY, "Whether the recorded code is still executing"},
     {NULL}
 };
 
 static PyMethodDef Recording_methods[] = {
     {"dicts",  (PyCFunction) Recording_dicts,  METH_VARARGS, "Get globals and locals dicts at step n"},
-    {"state",  (PyCFunction) Recording_state,  METH_VARARGS, "Get state dict at step n"},
+    {"state",  (PyCFunction) Recording_state,  METH_VARARGS | METH_KEYWORDS, "Get state dict at step n, only of the given names if names is not None, a lazily resolved mapping if lazy"},
+    {"state_now", (PyCFunction) Recording_state_now, METH_VARARGS | METH_KEYWORDS, "Get the state at the latest step, the same as state(steps() - 1)"},
+    {"diff",   (PyCFunction) Recording_diff,   METH_VARARGS, "Get (before, after) dicts of the names that changed between steps n1 and n2"},
+    {"find_change", (PyCFunction) Recording_find_change, METH_VARARGS | METH_KEYWORDS, "Get the first step after 'after' (or the last before 'before') where a name or path like X[3] changed, None if there is none"},
+    {"find",   (PyCFunction) Recording_find,   METH_VARARGS, "Get the first step in [n0, n1) where predicate(state) holds, assuming it keeps holding once it does"},
+    {"states", (PyCFunction) Recording_states, METH_VARARGS | METH_KEYWORDS, "Get [state(n) for n in steps], replaying each milestone once, split over worker processes if processes > 1"},
+    {"history", (PyCFunction) Recording_history, METH_VARARGS, "Get the steps in [start, stop) where a variable called name was bound, or its object mutated"},
+    {"series", (PyCFunction) Recording_series, METH_VARARGS, "Get [(step, value)] of a variable called name at each step of history(name, start, stop)"},
+    {"cursor", (PyCFunction) Recording_cursor, METH_VARARGS, "Get a cursor for replaying states step by step"},
     {"steps",  (PyCFunction) Recording_steps,  METH_VARARGS, "Get total number of steps in recording"},
     {"line",   (PyCFunction) Recording_line,   METH_VARARGS, "Get the line that was executed at step n"},
-    {"visits", (PyCFunction) Recording_visits, METH_VARARGS, "Get list of steps that visit line l"},
+    {"offset", (PyCFunction) Recording_offset, METH_VARARGS, "Get the instruction offset of step n, or None for line steps"},
+    {"visits", (PyCFunction) Recording_visits, METH_VARARGS, "Get steps that visit line l, optionally only those in [start, stop)"},
+    {"count",  (PyCFunction) Recording_count,  METH_VARARGS, "Count steps that visit line l, optionally only those in [start, stop)"},
+    {"time",   (PyCFunction) Recording_time,   METH_VARARGS, "Get the time in seconds, since the first step, that step n started"},
+    {"step_at_time", (PyCFunction) Recording_step_at_time, METH_VARARGS, "Get the step that was executing t seconds after the first step"},
+    {"next_in_frame", (PyCFunction) Recording_next_in_frame, METH_VARARGS, "Get the next step in the same frame as step n, or None if it returned"},
+    {"step_over", (PyCFunction) Recording_step_over, METH_VARARGS, "Get the next step after n that isn't inside a call made by n's frame"},
+    {"step_out", (PyCFunction) Recording_step_out, METH_VARARGS, "Get the step after n's frame returned to its caller"},
+    {"step_back", (PyCFunction) Recording_step_back, METH_VARARGS, "Get the previous step before n that isn't inside a call made by n's frame"},
+    {"prev_call", (PyCFunction) Recording_prev_call, METH_VARARGS, "Get the first step of the previous call of the function running at step n"},
+    {"stack", (PyCFunction) Recording_stack, METH_VARARGS, "Get [{'name', 'line', 'locals'}] for each frame active at step n, outermost first"},
+    {"call_counts", (PyCFunction) Recording_call_counts, METH_VARARGS, "Get {(name, first line): number of calls}"},
+    {"profile", (PyCFunction) Recording_profile, METH_VARARGS, "Get {'lines': {line: (visits, self, inclusive)}, 'functions': {(name, first line): (calls, self, inclusive)}} in seconds"},
     {NULL}
 };
 
@@ -334,6 +2491,7 @@ RecordingObject* Recording_New(PyObject* code){
     if(io_module == NULL){
         io_module = PyImport_ImportModule("io");
         pickle_module = PyImport_ImportModule("_pickle");
+        copy_module = PyImport_ImportModule("copy");
     }
 
     auto self = (RecordingObject*)Recording_new(&RecordingType, NULL, NULL);
@@ -342,10 +2500,30 @@ RecordingObject* Recording_New(PyObject* code){
     return self;
 }
 
+CallId Recording_call_id(RecordingObject* self, PyFrameObject* frame){
+    // Frames get a new CallId the first time they are seen after being called
+    auto it = self->live_calls.find(frame);
+    if(it != self->live_calls.end()){
+        return it->second;
+    }
+    auto call = (CallId)self->call_records.size();
+    self->call_records.push_back({(PyObject*)frame->f_code, NO_STEP, NO_STEP, NO_CALL, 0});
+    self->live_calls[frame] = call;
+    return call;
+}
+
 bool Recording_object_tracked(RecordingObject* self, PyObject* obj){
     return self->tracked_objects.contains(obj);
 }
 
+static size_t Recording_pickle_offset(RecordingObject* self){
+    // Bytes pickled into the current Milestone so far
+    auto position = PyObject_CallMethodObjArgs(std::get<2>(self->milestones.back()), tell_str, NULL);
+    size_t offset = position ? PyLong_AsSize_t(position) : 0;
+    Py_XDECREF(position);
+    return offset;
+}
+
 int track_object(PyObject* obj, PyObject* args){
     auto self = (RecordingObject*)args;
     if(obj != NULL && !PyModule_Check(obj)){
@@ -354,13 +2532,28 @@ int track_object(PyObject* obj, PyObject* args){
             self->tracked_objects.insert(obj);
 
             // This object hasn't been pickled for this Milestone yet...
+            size_t offset = 0;
+            bool saved = true;
             if(!is_const){
-                PyObject_CallMethodObjArgs(self->pickler, dump_str, obj, NULL);
+                offset = Recording_pickle_offset(self);
+                auto done = PyObject_CallMethodObjArgs(self->pickler, dump_str, obj, NULL);
+                saved = done != NULL;
+                Py_XDECREF(done);
+                PyErr_Clear();
             }
 
-            if(PyErr_Occurred() == NULL){
+            if(!saved){
+                // Can't be replayed, keep it alive so states can still show it as it is now
+                auto key = Py_BuildValue("(On)", (PyObject*)Py_TYPE(obj), (Py_ssize_t)obj);
+                PyDict_SetItem(self->consts, key, obj);
+                Py_DECREF(key);
+            } else {
+                auto parent = self->pickle_parent;
                 if(!is_const){
-                    self->pickle_order->push_back(obj);
+                    // Found inside the parent, so pickled as part of it
+                    auto writing = Recording_writing(self);
+                    self->pickle_parent = self->pickle_order->push_back(obj, offset);
+                    self->pickle_order->inside(self->pickle_parent, parent);
                 }
 
                 // Saved object successfully, track it's sub-objects too
@@ -372,8 +2565,13 @@ int track_object(PyObject* obj, PyObject* args){
                         traverse(obj, (visitproc)track_object, args);
                     }
                 }
+                self->pickle_parent = parent;
             }
             PyErr_Clear();  
+        } else {
+            // Pickled earlier, the parent's dump refers to it
+            auto writing = Recording_writing(self);
+            self->pickle_order->depend(self->pickle_parent, self->pickle_order->dump_of(obj));
         }
     }
     return 0;
@@ -383,9 +2581,64 @@ void Recording_track_object(RecordingObject* self, PyObject* object){
     track_object(object, (PyObject*)self);
 }
 
+static bool Recording_user_instance(PyObject* obj, int depth = 0){
+    // Whether obj is, or holds, an instance of a class the Python code defined. These are
+    // hashable by identity but mutable, so they are pickled and replayed, not consts
+    auto type = Py_TYPE(obj);
+    if(type == &PyTuple_Type){
+        for(Py_ssize_t i = 0; i < PyTuple_GET_SIZE(obj); i++){
+            if(depth < 4 && Recording_user_instance(PyTuple_GET_ITEM(obj, i), depth + 1)){
+                return true;
+            }
+        }
+    } else if(type == &PyFrozenSet_Type){
+        Py_ssize_t i = 0;
+        PyObject* item;
+        Py_hash_t hash;
+        while(_PySet_NextEntry(obj, &i, &item, &hash)){
+            if(depth < 4 && Recording_user_instance(item, depth + 1)){
+                return true;
+            }
+        }
+    } else if(PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE) && !PyType_Check(obj)){
+        return true;
+    }
+    return false;
+}
+
+static bool Recording_native_hash(PyObject* obj, int depth = 0){
+    // Whether hashing and comparing obj runs no Python code, i.e. no __hash__ or __eq__
+    // written in Python, neither its own nor that of anything in it
+    auto type = Py_TYPE(obj);
+    if(type == &PyTuple_Type){
+        for(Py_ssize_t i = 0; i < PyTuple_GET_SIZE(obj); i++){
+            if(depth == 4 || !Recording_native_hash(PyTuple_GET_ITEM(obj, i), depth + 1)){
+                return false;
+            }
+        }
+    } else if(type == &PyFrozenSet_Type){
+        Py_ssize_t i = 0;
+        PyObject* item;
+        Py_hash_t hash;
+        while(_PySet_NextEntry(obj, &i, &item, &hash)){
+            if(depth == 4 || !Recording_native_hash(item, depth + 1)){
+                return false;
+            }
+        }
+    } else if(PyType_HasFeature(type, Py_TPFLAGS_HEAPTYPE)){
+        for(auto name : {hash_str, eq_str}){
+            auto method = _PyType_Lookup(type, name);
+            if(method != NULL && PyFunction_Check(method)){
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 bool Recording_check_const(RecordingObject* self, PyObject* &obj){
     if(obj != NULL){
-        if(Py_TYPE(obj)->tp_hash == PyObject_HashNotImplemented){
+        if(Py_TYPE(obj)->tp_hash == PyObject_HashNotImplemented || Recording_user_instance(obj)){
             return false;
         } else {
             PyObject* key = obj;
@@ -404,7 +2657,6 @@ bool Recording_check_const(RecordingObject* self, PyObject* &obj){
 
             if(saved_obj == NULL){
                 PyDict_SetItem(self->consts, key, obj);     // Save new const object (this also stops GC)
-                self->objects[obj] = obj;
                 saved_obj = obj;
             }
 
@@ -421,22 +2673,57 @@ bool Recording_check_const(RecordingObject* self, PyObject* &obj){
 
 int Recording_record_trace_event(RecordingObject* self, int event, PyFrameObject* frame){
     int line_number = frame->f_lineno;
+    auto step = (long)self->lines.size();
+    auto writing = Recording_writing(self);
 /*
 */
-    // Save step number for this line visit
-    while(PyList_Size(self->visits) < line_number){
-        auto new_list = PyList_New(0);
-        PyList_Append(self->visits, new_list);
-        Py_DECREF(new_list);
-    }
-    auto visit_list = PyList_GetItem(self->visits, line_number - 1);
-    auto step = (long)self->steps.size();
-    auto py_step = PyLong_FromLong(step);
-    PyList_Append(visit_list, py_step);
-    Py_DECREF(py_step);
+    // Save step number for this line visit (instruction steps are part of the visit)
+    if(event != PyTrace_OPCODE && line_number > 0){
+        if(self->visits.size() < (size_t)line_number){
+            self->visits.resize(line_number);
+        }
+        self->visits[line_number - 1].push_back(step);
+    }
     
-    // Save line number for this step
-    self->steps.push_back(Step(line_number, event, frame));
+    // Maintain the call tree
+    auto call = Recording_call_id(self, frame);
+    auto& stack = self->call_stack;
+    if(event == PyTrace_CALL || self->call_records[call].enter == NO_STEP){
+        auto& record = self->call_records[call];
+        record.enter = step;
+        record.parent = stack.empty() ? NO_CALL : stack.back();
+        record.depth = (uint32_t)stack.size();
+        stack.push_back(call);
+        self->function_calls[record.code].push_back(call);
+    } else {
+        while(stack.size() > 1 && stack.back() != call){
+            self->call_records[stack.back()].exit = step - 1;   // Ended without a return event
+            stack.pop_back();
+        }
+    }
+
+    // Save line number, event and call instance for this step
+    self->lines.push_back(line_number);
+    self->events.push_back(event == PyTrace_OPCODE ? PyTrace_LINE : event);
+    self->calls.push_back(call);
+    self->depths.push_back(self->call_records[call].depth);
+    if(self->timing){
+        self->times.push_back(clock_ns());
+    }
+    if(event == PyTrace_RETURN){
+        self->live_calls.erase(frame);      // Frame may be freed and its address reused
+        self->call_records[call].exit = step;
+        if(!stack.empty() && stack.back() == call){
+            stack.pop_back();
+        }
+    }
+    if(self->opcode_granularity){
+        bool instruction = event == PyTrace_OPCODE && frame->f_lasti < NO_OFFSET;
+        self->offsets.push_back(instruction ? (StepOffset)frame->f_lasti : NO_OFFSET);
+    }
+    if(writing){
+        writing.unlock();   // The callback may query the recording
+    }
     if(self->callback){
         self->callback_counter += 1;
         if(self->callback_counter >= 50000){
@@ -477,24 +2764,182 @@ void Recording_make_callback(RecordingObject* self){
     }
 }
 
+int Recording_oparg(PyFrameObject* frame){
+    // Argument of the frame's current instruction, including any EXTENDED_ARG before it
+    auto code = (unsigned char*)PyBytes_AS_STRING(frame->f_code->co_code);
+    int i = frame->f_lasti;
+    int oparg = code[i + 1];
+    for(int shift = 8; i >= 2 && code[i - 2] == EXTENDED_ARG && shift < 32; shift += 8){
+        i -= 2;
+        oparg |= code[i + 1] << shift;
+    }
+    return oparg;
+}
+
+static bool Recording_dict_prior(PyObject* dict, PyObject* key, PyObject*& value){
+    // Borrowed value of key in dict, if looking it up can't run Python code: neither key nor
+    // the dict's keys hash in Python, either all str (known without a scan) or few enough to check
+    const Py_ssize_t SCAN = 64;
+    if(!Recording_native_hash(key)){
+        return false;
+    }
+    if(!PyUnicode_CheckExact(key) || !_PyDict_HasOnlyStringKeys(dict)){
+        if(PyDict_GET_SIZE(dict) > SCAN){
+            return false;
+        }
+        PyObject *k, *v;
+        Py_ssize_t i = 0;
+        while(PyDict_Next(dict, &i, &k, &v)){
+            if(!Recording_native_hash(k)){
+                return false;
+            }
+        }
+    }
+    value = PyDict_GetItem(dict, key);
+    return true;
+}
+
+static Prior Recording_prior(RecordingObject* self, int event, PyObject* a, PyObject* b, PyObject* c){
+    // What the mutation is about to overwrite. Only looked up where that has no side
+    // effects, and only kept when it stays valid: a const, or an object with a replayed copy
+    // (c, the value being stored, gets one right after, e.g. as a Milestone snapshots the frames).
+    const Prior unknown = {false, NULL};
+    PyObject* value = NULL;     // Borrowed
+    PyObject* temp = NULL;
+    if(event == DELETE_FAST || event == DELETE_NAME || event == DELETE_GLOBAL || event == DELETE_ATTR
+       || (event == DELETE_SUBSCR && !PyList_CheckExact(a))){
+        return unknown;     // Putting a deleted key back would move it to the end of its dict
+    }
+    switch(event){
+        case STORE_FAST:
+        case DELETE_FAST: {
+            // The local the frame's instruction is about to store to
+            auto frame = (PyFrameObject*)a;
+            auto names = frame->f_code->co_varnames;
+            auto i = Recording_oparg(frame);
+            if(i >= PyTuple_GET_SIZE(names) || PyTuple_GET_ITEM(names, i) != b){
+                return unknown;
+            }
+            value = frame->f_localsplus[i];
+            break;
+        }
+        case STORE_NAME:
+        case DELETE_NAME:
+        case STORE_GLOBAL:
+        case DELETE_GLOBAL: {
+            auto frame = (PyFrameObject*)a;
+            auto dict = event == STORE_GLOBAL || event == DELETE_GLOBAL ? frame->f_globals : frame->f_locals;
+            if(dict == NULL || !PyDict_CheckExact(dict) || !Recording_dict_prior(dict, b, value)){
+                return unknown;
+            }
+            break;
+        }
+        case STORE_SUBSCR:
+        case DELETE_SUBSCR:
+            if(PyDict_CheckExact(a)){
+                if(!Recording_dict_prior(a, b, value)){
+                    return unknown;     // Looking it up could run a key's __hash__ or __eq__
+                }
+            } else if(PyList_CheckExact(a) && PyLong_CheckExact(b)){
+                auto i = PyLong_AsSsize_t(b);
+                auto size = PyList_GET_SIZE(a);
+                i = i < 0 ? i + size : i;
+                if(PyErr_Occurred() || i < 0 || i >= size){
+                    PyErr_Clear();
+                    return unknown;     // The mutation is about to fail anyway
+                }
+                value = PyList_GET_ITEM(a, i);
+            } else {
+                return unknown;
+            }
+            break;
+        case STORE_ATTR:
+        case DELETE_ATTR: {
+            auto descr = _PyType_Lookup(Py_TYPE(a), b);
+            auto dict_ptr = _PyObject_GetDictPtr(a);
+            if(dict_ptr == NULL || (descr != NULL && Py_TYPE(descr)->tp_descr_set != NULL)){
+                return unknown;     // e.g. a property or __slots__
+            }
+            if(*dict_ptr && !Recording_dict_prior(*dict_ptr, b, value)){
+                return unknown;
+            }
+            break;
+        }
+        default:
+            // In place operation, lists only ever grow so their old length is enough
+            if(PyList_CheckExact(a) && (event == INPLACE_ADD || event == INPLACE_MULTIPLY)){
+                value = temp = PyLong_FromSsize_t(PyList_GET_SIZE(a));
+            } else if(Recording_check_const(self, a)){
+                return {true, NULL};    // Consts get no replayed copy, so there's nothing to undo
+            } else {
+                return unknown;
+            }
+    }
+
+    Prior prior = {true, value};
+    if(value != NULL && !Recording_check_const(self, prior.value) && value != c && !Recording_object_tracked(self, value)){
+        prior = unknown;
+    }
+    if(temp != NULL){
+        Py_DECREF(temp);    // The consts dict keeps the saved length alive
+    }
+    return prior;
+}
+
+static SkipKind Recording_skip_kind(int event, PyObject* a, PyObject* b, bool b_const){
+    // How the log's skip tables may fold the mutation, see MutationLog
+    switch(event){
+        case STORE_SUBSCR:
+        case DELETE_SUBSCR:
+            if(PyDict_CheckExact(a) && (PyUnicode_CheckExact(b) || PyLong_CheckExact(b))){
+                return SKIP_KEYED;      // Equal keys are the same const
+            }
+            if(event == STORE_SUBSCR && PyList_CheckExact(a) && PyLong_CheckExact(b) && _PyLong_Sign(b) >= 0){
+                return SKIP_KEYED;      // Negative indexes would alias, deletes shift the items
+            }
+            return SKIP_ORDERED;
+        case STORE_ATTR:
+        case DELETE_ATTR: {
+            auto descr = _PyType_Lookup(Py_TYPE(a), b);
+            if(_PyObject_GetDictPtr(a) == NULL || (descr != NULL && Py_TYPE(descr)->tp_descr_set != NULL)){
+                return SKIP_ORDERED;
+            }
+            return SKIP_KEYED;
+        }
+        default:
+            // In place operation, which also reads b
+            return b_const ? SKIP_ORDERED : SKIP_READS;
+    }
+}
+
 int Recording_record(RecordingObject* self, int event, PyObject* a, PyObject* b, PyObject* c){
-    Mutation mutation;
+    CallId call = NO_CALL;
     int err = 0;
     switch(event){
         case PyTrace_CALL:
         case PyTrace_EXCEPTION:
         case PyTrace_LINE:
         case PyTrace_RETURN:
+        case PyTrace_OPCODE:
             err = Recording_record_trace_event(self, event, (PyFrameObject*)a);
             break;
         default:
             // Mutation event
-            Recording_check_const(self, b);
+            auto prior = Recording_prior(self, event, a, b, c);
+            bool b_const = Recording_check_const(self, b);
             Recording_check_const(self, c);
             Recording_track_object(self, b);
             Recording_track_object(self, c);
-            mutation = Mutation(self->steps.size(), event, a, b, c);
-            self->mutations->push_back(mutation);
+            auto kind = SKIP_ORDERED;
+            if(is_name_binding(event)){
+                bool global = event == STORE_GLOBAL || event == DELETE_GLOBAL;
+                call = global && self->global_call != NO_CALL ? self->global_call : Recording_call_id(self, (PyFrameObject*)a);
+                a = NULL;
+            } else {
+                kind = Recording_skip_kind(event, a, b, b_const);
+            }
+            auto writing = Recording_writing(self);
+            self->mutations->append(self->lines.size(), event, call, a, b, c, prior, kind);
             break;
     }
 
@@ -3,15 +3,170 @@
 #include "frameobject.h"
 #include <vector>
 #include <tuple>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include "parallel_hashmap/phmap.h"
+#include "columns.h"
+#include "mutation_log.h"
+#include "postings.h"
+#include "pickle_order.h"
 
-using Step = std::tuple<int, int, PyFrameObject*>;
-using Mutation = std::tuple<size_t, unsigned char, PyObject*, PyObject*, PyObject*>;
-using MutationList = std::vector<Mutation>;
+using StepOffset = unsigned short;          // Instruction offset of an opcode-granularity step
+const StepOffset NO_OFFSET = 0xFFFF;        // Step is a line/call/return/exception event
+using CallMap = phmap::flat_hash_map<PyFrameObject*, CallId>;
+
+const size_t NO_STEP = (size_t)-1;
+const size_t NO_MILESTONE = (size_t)-1;
+
+// One node of the call tree, steps [enter, exit] belong to the call or its callees
+struct CallRecord {
+    PyObject*   code;       // Code object of the call (borrowed, part of the recording's code)
+    size_t      enter;      // Step of the PyTrace_CALL event
+    size_t      exit;       // Step of the PyTrace_RETURN event, NO_STEP while running
+    CallId      parent;
+    uint32_t    depth;      // 0 for the module level
+};
+using FunctionCalls = phmap::flat_hash_map<PyObject*, std::vector<CallId>>;
 using ObjectSet = phmap::flat_hash_set<PyObject*>;
 using ObjectMap = phmap::flat_hash_map<PyObject*, PyObject*>;
-using PickleOrder = std::vector<PyObject*>;
-using Milestone = std::tuple<MutationList*, PickleOrder*, PyObject*>;
+using Milestone = std::tuple<MutationLog*, PickleOrder*, PyObject*>;
+
+// Where a query's replayed objects came from
+enum ReplaySource { FROM_MILESTONE, FROM_CACHE, UNDO_FROM_CACHE };
+
+// Replayed copies of the objects of one Milestone, as they were at one step
+struct ReplayState {
+    ObjectMap   objects;                    // Recorded object -> its replayed copy (owned)
+    size_t      milestone = NO_MILESTONE;
+    size_t      step = 0;
+    size_t      bytes = 0;                  // Size of the snapshot the objects were loaded from
+    size_t      dumps = 0;                  // Dumps of the snapshot loaded, a Milestone still recording adds more
+
+    // copy_of() each object of 'log' by its index in the log's table, Py_None until looked up
+    // (consts never have copies). Replay resolves each object once instead of hashing per mutation.
+    std::vector<PyObject*>  copies;
+    const MutationLog*      copies_log = NULL;
+    size_t                  copies_objects = 0;     // Size of 'objects' when 'copies' was started
+
+    // Loaded while its Milestone was still recording: the snapshot's bytes copied so far ('bytes'
+    // of them) and the Unpickler reading them, so dumps added later load into the same objects
+    PyObject*               stream = NULL;
+    PyObject*               unpickler = NULL;
+
+    ReplayState() = default;
+    ReplayState(const ReplayState&) = delete;
+    ~ReplayState(){
+        clear();
+    }
+
+    PyObject* copy_of(PyObject* obj) const {
+        auto it = objects.find(obj);
+        return it == objects.end() ? NULL : it->second;
+    }
+
+    // The value obj had, objects without a copy (consts) are their own value
+    PyObject* value(PyObject* obj) const {
+        auto copy = copy_of(obj);
+        return copy ? copy : obj;
+    }
+
+    // copy_of() a mutation's object by its Mutation::ref_*
+    PyObject* copy_at(const MutationLog* log, size_t ref){
+        if(log != copies_log || objects.size() != copies_objects){
+            copies.assign(log->objects(), Py_None);    // More objects were loaded
+            copies_log = log;
+            copies_objects = objects.size();
+        } else if(ref >= copies.size()){
+            copies.resize(log->objects(), Py_None);    // The log is still recording
+        }
+        auto& copy = copies[ref];
+        if(copy == Py_None){
+            copy = copy_of(log->object(ref));
+        }
+        return copy;
+    }
+
+    PyObject* value_at(const MutationLog* log, size_t ref){
+        auto copy = copy_at(log, ref);
+        return copy ? copy : log->object(ref);
+    }
+
+    void clear(){
+        for(auto& item : objects){
+            Py_XDECREF(item.second);
+        }
+        objects.clear();
+        copies.clear();
+        copies_log = NULL;
+        Py_CLEAR(unpickler);
+        Py_CLEAR(stream);
+        milestone = NO_MILESTONE;
+        step = 0;
+        bytes = 0;
+        dumps = 0;
+    }
+
+    void swap(ReplayState& other){
+        objects.swap(other.objects);
+        copies.swap(other.copies);
+        std::swap(copies_log, other.copies_log);
+        std::swap(copies_objects, other.copies_objects);
+        std::swap(milestone, other.milestone);
+        std::swap(step, other.step);
+        std::swap(bytes, other.bytes);
+        std::swap(dumps, other.dumps);
+        std::swap(stream, other.stream);
+        std::swap(unpickler, other.unpickler);
+    }
+};
+
+// ==== class MilestoneCache ====================
+/*
+    Replayed states of recently queried Milestones, so a query landing in one
+    of them replays on (or undoes back) from where it was left instead of
+    unpickling the snapshot again. States are charged the size of their
+    snapshot, and the least recently used are dropped to stay within budget.
+*/
+class MilestoneCache {
+public:
+    // Swap the cached state of a Milestone into 'state', false if there is none
+    bool take(size_t milestone, ReplayState& state){
+        for(size_t i = 0; i < states.size(); i++){
+            if(states[i]->milestone == milestone){
+                auto entry = std::move(states[i]);
+                states.erase(states.begin() + i);
+                bytes -= entry->bytes;
+                entry->swap(state);
+                if(entry->milestone != NO_MILESTONE){
+                    bytes += entry->bytes;
+                    states.push_back(std::move(entry));     // What 'state' held is now the most recent
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Move the objects of 'state' into the cache, leaving it empty
+    void put(ReplayState& state, size_t budget){
+        if(state.milestone == NO_MILESTONE){
+            return;
+        }
+        std::unique_ptr<ReplayState> entry(new ReplayState());
+        entry->swap(state);
+        bytes += entry->bytes;
+        states.push_back(std::move(entry));
+        while(!states.empty() && bytes > budget){
+            bytes -= states.front()->bytes;
+            states.erase(states.begin());
+        }
+    }
+
+private:
+    std::vector<std::unique_ptr<ReplayState>> states;   // Least recently used first
+    size_t bytes = 0;
+};
 
 /*
     The current implementation of this is fairly slow, but robust.
@@ -28,27 +183,139 @@ typedef struct {
     PyObject_HEAD
     PyObject*               code;           // Code object that is being executed
     bool                    record_state;   // Whether to record changes in state
+    bool                    opcode_granularity; // Whether mutating instructions get their own steps
+    bool                    timing;         // Whether to timestamp every step
+    bool                    running;        // Whether the code is still executing (queries see steps()-1 at most)
     long                    max_steps;      // Maximum execution steps before stopping
     PyObject*               callback;
     int                     callback_counter;
 
     bool                    fresh_milestone;
-    std::vector<Step>       steps;
-    PyObject*               visits;			// Use Python list because user can access it
+    PatternColumn<int>      lines;          // Steps are stored column-wise, this is the line of each step
+    PackedColumn<2>         events;         // PyTrace_CALL/EXCEPTION/LINE/RETURN (instruction steps are LINE)
+    PatternColumn<CallId>   calls;          // Call instance the step happened in
+    MinimaColumn<uint32_t>  depths;         // Call depth of the step
+    Column<StepOffset>      offsets;        // Only filled at opcode granularity
+    TimeColumn              times;          // Only filled when timing
+    CallMap                 live_calls;     // Frames currently executing, and their call instance
+    std::vector<PyObject*>  called_code;    // Code of other modules marked with this Recording while it runs
+    std::vector<CallRecord> call_records;   // Indexed by CallId
+    std::vector<CallId>     call_stack;     // Calls currently executing, innermost last
+    FunctionCalls           function_calls; // Calls of each code object, in order of entry
+    std::vector<PostingList> visits;        // Steps that visited each line, index is line - 1
     std::vector<Milestone>  milestones;
+    std::vector<size_t>     milestone_steps; // Step each Milestone starts at, ascending
     PyObject*               consts;
-    ObjectMap               objects;
+    ReplayState             replay;         // Objects as of the last query
+    ReplayState             tail;           // Objects as of the last query of the latest step
+    MilestoneCache          cache;          // States of other recently queried Milestones
+    Py_ssize_t              cache_bytes;    // Budget of the cache, in snapshot bytes
     ObjectSet               tracked_objects;
-    PyObject*               global_frame;
+    CallId                  global_call;    // Call instance of the module level frame
     
     PyObject*               pickler;        // Uses BytesIO from current Milestone
     PickleOrder*            pickle_order;   // Points into current Milestone
-    MutationList*           mutations;      // Points into current Milestone
+    uint32_t                pickle_parent;  // Dump whose sub-objects are being tracked
+    MutationLog*            mutations;      // Points into current Milestone
+    std::shared_timed_mutex lock;           // Exclusive while recording appends, shared by queries without the GIL
+    int                     native_queries; // Queries running without the GIL (changed with the GIL held)
 } RecordingObject;
 
+/*
+    Queries of several Python threads can run at once. A query does its
+    native work - finding names in the bindings, decoding mutations, working
+    out which dumps to load - without the GIL, holding the recording's lock
+    shared, and only takes the GIL back to touch Python objects. The recorder
+    takes the lock exclusively just while it appends to the structures those
+    phases read (columns, mutation logs, pickle orders, Milestones), never
+    while it calls into Python. When no query is in a native phase the GIL
+    keeps them out already, so the recorder doesn't lock at all.
+
+    While the code is still running, every step before lines.size() is
+    complete: its mutations are in the log and the objects they touch
+    are in its Milestone's snapshot. Queries up to there answer as they
+    would afterwards. A state loaded from the Milestone still recording
+    keeps its Unpickler, and loads the dumps added since into the same
+    objects when a later query moves it forwards.
+
+    Queries of the latest step use the recording's tail state, which only
+    ever moves forwards. A callback asking for the current state each time
+    replays just the steps since it last asked, whatever other steps are
+    queried in between.
+*/
+
+// Lock for the recorder to append under, only held when a query may be reading without the GIL
+inline std::unique_lock<std::shared_timed_mutex> Recording_writing(RecordingObject* self){
+    if(self->native_queries == 0){
+        return std::unique_lock<std::shared_timed_mutex>(self->lock, std::defer_lock);
+    }
+    return std::unique_lock<std::shared_timed_mutex>(self->lock);
+}
+
+// ==== class NativeSection ====================
+// Scope of a query's native phase: no GIL, recording locked shared
+class NativeSection {
+public:
+    explicit NativeSection(RecordingObject* recording) : recording(recording), reading(recording->lock, std::defer_lock) {
+        recording->native_queries++;
+        thread = PyEval_SaveThread();
+        reading.lock();
+    }
+
+    ~NativeSection(){
+        reading.unlock();
+        PyEval_RestoreThread(thread);
+        recording->native_queries--;
+    }
+
+private:
+    RecordingObject*                            recording;
+    PyThreadState*                              thread;
+    std::shared_lock<std::shared_timed_mutex>   reading;
+};
+
+// ==== class QueryReplay ====================
+/*
+    The recording's replayed objects, taken by one query while it runs. A
+    query of another thread starting meanwhile finds them taken and gets
+    its state from the cache (or the snapshot) instead, so two queries never
+    replay into the same objects. Whichever is given back first becomes the
+    recording's again, the other goes into the cache.
+*/
+class QueryReplay {
+public:
+    explicit QueryReplay(RecordingObject* recording) : QueryReplay(recording, recording->replay) {}
+
+    // Take the objects of one of the recording's states, 'replay' or 'tail'
+    QueryReplay(RecordingObject* recording, ReplayState& slot) : recording(recording), slot(slot) {
+        state.swap(slot);
+    }
+
+    ~QueryReplay(){
+        if(slot.milestone == NO_MILESTONE){
+            state.swap(slot);
+        } else {
+            recording->cache.put(state, std::max<Py_ssize_t>(0, recording->cache_bytes));
+        }
+    }
+
+    ReplayState         state;
+
+private:
+    RecordingObject*    recording;
+    ReplayState&        slot;
+};
+
 RecordingObject* Recording_New(PyObject* code);
 PyTypeObject* Recording_Type(void);
 
 int Recording_record(RecordingObject* self, int event, PyObject* a, PyObject* b, PyObject* c);
+CallId Recording_call_id(RecordingObject* self, PyFrameObject* frame);
+int Recording_oparg(PyFrameObject* frame);
+size_t Recording_milestone_at(RecordingObject* self, size_t step);
+ReplaySource Recording_replay(RecordingObject* self, ReplayState& state, size_t step, MilestoneCache* cache = NULL);
+void Recording_bind(ReplayState& state, const Mutation& binding, PyObject* dict, PyObject* memo);
+PyObject* Recording_named_state(RecordingObject* self, size_t step, PyObject* names, ObjectMap* clones = NULL);
+PyObject* Recording_bound_names(RecordingObject* self, size_t step);
 bool Recording_object_tracked(RecordingObject* self, PyObject* obj);
 void Recording_make_callback(RecordingObject* self);
@@ -2,7 +2,7 @@ from setuptools import setup, Extension
 
 execorder = Extension(
     'execorder',
-    sources=['execorder.cpp', 'recording.cpp'],
+    sources=['execorder.cpp', 'recording.cpp', 'visits.cpp', 'cursor.cpp', 'state_mapping.cpp'],
     extra_compile_args=['/std:c++14'],
     py_limited_api=False,
 )
@@ -0,0 +1,61 @@
+import random
+import execorder
+
+# Long runs overwriting and deleting the same few keys, items and attributes
+code = '''
+class P:
+    pass
+
+D = {}
+L = [0] * 8
+p = P()
+def churn(n):
+    acc = 0
+    for i in range(n):
+        k = i % 13
+        D[k] = i
+        D['s%d' % (i % 7)] = [i]
+        if i % 5 == 0:
+            del D[k]
+        if i % 9 == 0:
+            D['x'] = i
+        elif i % 11 == 0 and 'x' in D:
+            del D['x']
+        L[i % 8] = i
+        p.a = i
+        if i % 17 == 0:
+            del p.a
+            p.b = i
+        acc += i
+    return acc
+total = churn(6000)
+E = dict(D)
+for j in range(5000):
+    E[j % 4] = j
+    L[j % 3] = [j]
+'''
+
+def shown(state):
+    return repr(sorted((name, vars(value) if name == 'p' else value)
+                       for name, value in state.items() if name in ('D', 'L', 'p', 'E', 'total', 'j')))
+
+recording = execorder.exec(code)
+N = recording.steps()
+rnd = random.Random(1)
+steps = set(rnd.randrange(N) for _ in range(300)) | {0, N - 1}
+
+# States computed the plain way: a cursor stepping through every mutation in order
+reference = execorder.exec(code)
+reference.cache_bytes = 0
+expected = {}
+for n, state in enumerate(reference.cursor().iter(0, N)):
+    if n in steps:
+        expected[n] = shown(state)
+
+# Queries jump over runs of repeated writes, in any order
+for n in rnd.sample(sorted(steps), len(steps)):
+    assert shown(recording.state(n)) == expected[n], n
+for n, state in zip(sorted(steps), recording.states(sorted(steps))):
+    assert shown(state) == expected[n], n
+
+print('OK')
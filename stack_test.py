@@ -0,0 +1,52 @@
+import execorder
+
+code = '''
+def fact(k, seen):
+    seen.append(k)
+    if k <= 1:
+        r = 1
+    else:
+        r = k * fact(k - 1, seen)
+    return r
+
+def run():
+    seen = []
+    total = 0
+    for j in range(3):
+        total += fact(4 + j, seen)
+    return total
+
+T = run()
+'''
+
+recording = execorder.exec(code)
+N = recording.steps()
+
+# States computed the plain way
+reference = execorder.exec(code)
+reference.cache_bytes = 0
+
+deepest = 0
+for n in range(N):
+    stack = recording.stack(n)
+    names = [frame['name'] for frame in stack]
+    assert names[0] == '<module>' and stack[-1]['line'] == recording.line(n), (n, names)
+    deepest = max(deepest, len(stack))
+
+    # The innermost frame's locals over the module's are the state
+    merged = dict(stack[0]['locals'])
+    merged.update(stack[-1]['locals'])
+    expected = reference.state(n)
+    for name in ('k', 'r', 'j', 'total', 'seen', 'T'):
+        assert merged.get(name) == expected.get(name), (n, name, merged.get(name), expected.get(name))
+
+    # Each call of fact() is one below its caller, and they all share seen
+    calls = [frame['locals'] for frame in stack if frame['name'] == 'fact']
+    for outer, inner in zip(calls, calls[1:]):
+        assert inner['k'] == outer['k'] - 1, (n, [c['k'] for c in calls])
+        assert inner['seen'] is outer['seen'], n
+    if calls and 'seen' in stack[1]['locals']:
+        assert calls[0]['seen'] is stack[1]['locals']['seen'], n
+
+assert deepest == 2 + 6, deepest      # <module>, run() and fact(6) down to fact(1)
+print('OK')
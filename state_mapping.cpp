@@ -0,0 +1,204 @@
+#include "state_mapping.h"
+
+static int StateMapping_resolve(StateMappingObject* self, PyObject* names){
+    // Replay the values of 'names' (a set) in one go, skipping those already resolved
+    PyObject* missing = PySet_New(NULL);
+    auto it = PyObject_GetIter(names);
+    PyObject* name;
+    while((name = PyIter_Next(it)) != NULL){
+        if(!PyDict_Contains(self->values, name)){
+            PySet_Add(missing, name);
+        }
+        Py_DECREF(name);
+    }
+    Py_DECREF(it);
+    if(PySet_GET_SIZE(missing) > 0){
+        auto state = Recording_named_state(self->recording, self->step, missing, &self->clones);
+        PyDict_Update(self->values, state);
+        Py_DECREF(state);
+    }
+    Py_DECREF(missing);
+    return 0;
+}
+
+static PyObject* StateMapping_materialize(StateMappingObject* self){
+    // New dict of the whole state, in state order
+    if(PyDict_GET_SIZE(self->values) < PyDict_GET_SIZE(self->bound)){
+        StateMapping_resolve(self, self->bound);
+    }
+    auto dict = PyDict_New();
+    PyObject *name, *none;
+    Py_ssize_t i = 0;
+    while(PyDict_Next(self->bound, &i, &name, &none)){
+        auto value = PyDict_GetItem(self->values, name);
+        if(value != NULL){
+            PyDict_SetItem(dict, name, value);
+        }
+    }
+    return dict;
+}
+
+static void StateMapping_dealloc(StateMappingObject* self){
+    Py_DECREF(self->recording);
+    Py_DECREF(self->bound);
+    Py_DECREF(self->values);
+    for(auto& item : self->clones){
+        Py_DECREF(item.second);
+    }
+    self->clones.~ObjectMap();
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static Py_ssize_t StateMapping_length(StateMappingObject* self){
+    return PyDict_GET_SIZE(self->bound);
+}
+
+static PyObject* StateMapping_subscript(StateMappingObject* self, PyObject* key){
+    if(!PyDict_Contains(self->bound, key)){
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+    auto value = PyDict_GetItem(self->values, key);
+    if(value == NULL){
+        auto names = PySet_New(NULL);
+        PySet_Add(names, key);
+        StateMapping_resolve(self, names);
+        Py_DECREF(names);
+        value = PyDict_GetItem(self->values, key);
+        if(value == NULL){
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        }
+    }
+    Py_INCREF(value);
+    return value;
+}
+
+static int StateMapping_contains(StateMappingObject* self, PyObject* key){
+    return PyDict_Contains(self->bound, key);
+}
+
+static PyObject* StateMapping_iter(StateMappingObject* self){
+    return PyObject_GetIter(self->bound);
+}
+
+static PyObject* StateMapping_keys(StateMappingObject* self, PyObject* unused){
+    return PyDict_Keys(self->bound);
+}
+
+static PyObject* StateMapping_values(StateMappingObject* self, PyObject* unused){
+    auto dict = StateMapping_materialize(self);
+    auto values = PyDict_Values(dict);
+    Py_DECREF(dict);
+    return values;
+}
+
+static PyObject* StateMapping_items(StateMappingObject* self, PyObject* unused){
+    auto dict = StateMapping_materialize(self);
+    auto items = PyDict_Items(dict);
+    Py_DECREF(dict);
+    return items;
+}
+
+static PyObject* StateMapping_get(StateMappingObject* self, PyObject* args){
+    PyObject *key, *fallback = Py_None;
+    if(!PyArg_UnpackTuple(args, "get", 1, 2, &key, &fallback)){
+        return NULL;
+    }
+    if(!PyDict_Contains(self->bound, key)){
+        Py_INCREF(fallback);
+        return fallback;
+    }
+    return StateMapping_subscript(self, key);
+}
+
+static PyObject* StateMapping_repr(StateMappingObject* self){
+    auto dict = StateMapping_materialize(self);
+    auto repr = PyObject_Repr(dict);
+    Py_DECREF(dict);
+    return repr;
+}
+
+static PyObject* StateMapping_richcompare(StateMappingObject* self, PyObject* other, int op){
+    if((op != Py_EQ && op != Py_NE) || !(PyDict_Check(other) || Py_TYPE(other) == StateMapping_Type())){
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    auto dict = StateMapping_materialize(self);
+    auto other_dict = other;
+    if(Py_TYPE(other) == StateMapping_Type()){
+        other_dict = StateMapping_materialize((StateMappingObject*)other);
+    } else {
+        Py_INCREF(other_dict);
+    }
+    auto result = PyObject_RichCompare(dict, other_dict, op);
+    Py_DECREF(dict); Py_DECREF(other_dict);
+    return result;
+}
+
+static PyMethodDef StateMapping_methods[] = {
+    {"keys",   (PyCFunction) StateMapping_keys,   METH_NOARGS,  "Names of the state, without replaying anything"},
+    {"values", (PyCFunction) StateMapping_values, METH_NOARGS,  "Values of every name, resolving those not read yet"},
+    {"items",  (PyCFunction) StateMapping_items,  METH_NOARGS,  "(name, value) pairs, resolving those not read yet"},
+    {"get",    (PyCFunction) StateMapping_get,    METH_VARARGS, "Value of a name, or default if it isn't bound"},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods StateMapping_sequence = {
+    0, 0, 0, 0, 0, 0, 0,
+    (objobjproc) StateMapping_contains,         /* sq_contains */
+};
+
+static PyMappingMethods StateMapping_mapping = {
+    (lenfunc) StateMapping_length,              /* mp_length */
+    (binaryfunc) StateMapping_subscript,        /* mp_subscript */
+};
+
+static PyTypeObject StateMappingType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "execorder.StateMapping",
+    sizeof(StateMappingObject),
+    0,
+    (destructor) StateMapping_dealloc,          /* tp_dealloc */
+    0, 0, 0, 0,
+    (reprfunc) StateMapping_repr,               /* tp_repr */
+    0,
+    &StateMapping_sequence,                     /* tp_as_sequence */
+    &StateMapping_mapping,                      /* tp_as_mapping */
+    0, 0, 0, 0, 0, 0,
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    "Names bound at one step of a recording, values replayed on first read", /* tp_doc */
+    0, 0,
+    (richcmpfunc) StateMapping_richcompare,     /* tp_richcompare */
+    0,
+    (getiterfunc) StateMapping_iter,            /* tp_iter */
+    0,
+    StateMapping_methods,                       /* tp_methods */
+};
+
+PyTypeObject* StateMapping_Type(){
+    return &StateMappingType;
+}
+
+PyObject* StateMapping_New(RecordingObject* recording, size_t step, PyObject* names){
+    // Only the given names if names isn't NULL
+    auto self = PyObject_New(StateMappingObject, &StateMappingType);
+    Py_INCREF(recording);
+    self->recording = recording;
+    self->step = step;
+    self->bound = Recording_bound_names(recording, step);
+    self->values = PyDict_New();
+    new (&self->clones) ObjectMap();
+    if(names != NULL){
+        auto bound = PyDict_New();
+        PyObject *name, *none;
+        Py_ssize_t i = 0;
+        while(PyDict_Next(self->bound, &i, &name, &none)){
+            if(PySet_Contains(names, name) == 1){
+                PyDict_SetItem(bound, name, Py_None);
+            }
+        }
+        Py_DECREF(self->bound);
+        self->bound = bound;
+    }
+    return (PyObject*)self;
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include "Python.h"
+#include "recording.h"
+
+// ==== class StateMapping ====================
+// Read only mapping of the names bound at one step, values are replayed when first read
+typedef struct {
+    PyObject_HEAD
+    RecordingObject*        recording;
+    size_t                  step;
+    PyObject*               bound;          // Name -> None for each name of the state, in state order
+    PyObject*               values;         // Name -> value of the names resolved so far
+    ObjectMap               clones;         // Recorded object -> its clone in values (owned), kept so
+                                            // names resolved later share objects with earlier ones
+} StateMappingObject;
+
+PyObject* StateMapping_New(RecordingObject* recording, size_t step, PyObject* names);
+PyTypeObject* StateMapping_Type(void);
@@ -0,0 +1,44 @@
+import execorder
+
+code = '''
+class P:
+    pass
+
+p = P()
+X = [0] * 20
+D = {}
+for i in range(100000):
+    X[i % 20] = i
+    D[i % 7] = [i, X[(i + 1) % 20]]
+    p.a = i
+'''
+
+def shown(state):
+    return repr(sorted((name, vars(value) if name == 'p' else value)
+                       for name, value in state.items() if name in ('p', 'X', 'D', 'i')))
+
+# The callback asks for the latest state each time, looking back in between
+got = []
+def callback(recording):
+    n = recording.steps() - 1
+    if n >= 0:
+        got.append((n, None, shown(recording.state_now())))
+        got.append((n, ['X', 'p'], shown(recording.state_now(names=['X', 'p']))))
+        got.append((n, None, shown(dict(recording.state_now(lazy=True)))))
+        recording.state(n // 2)
+
+recording = execorder.exec(code, callback=callback)
+assert len(got) > 10, len(got)
+
+# After it finished it is the last step's state
+last = recording.steps() - 1
+got.append((last, None, shown(recording.state_now())))
+
+# All of them match the states computed the plain way
+reference = execorder.exec(code)
+reference.cache_bytes = 0
+for n, names, value in got:
+    expected = shown(reference.state(n, names=names))
+    assert value == expected, (n, names, value[:200], expected[:200])
+
+print('OK')
@@ -0,0 +1,43 @@
+import execorder
+
+code = '''
+X = []
+D = {}
+for i in range(30000):
+    X += [i]
+    if len(X) > 10:
+        X[i % 10] = -i
+    D[i % 13] = X[-3:]
+'''
+
+recording = execorder.exec(code)
+N = recording.steps()
+
+# States computed the plain way, one at a time
+reference = execorder.exec(code)
+reference.cache_bytes = 0
+
+def expected(n, names=None):
+    return {name: value for name, value in reference.state(n, names=names).items() if name != '__builtins__'}
+
+def without_builtins(state):
+    return {name: value for name, value in state.items() if name != '__builtins__'}
+
+# Steps out of order, repeated, and spread over several milestones
+steps = [N - 1, 5, 0, 5, N // 2, 3, N // 3, N - 2, N // 2 + 1, 1000, 999]
+states = recording.states(steps)
+assert len(states) == len(steps)
+for n, state in zip(steps, states):
+    assert without_builtins(state) == expected(n), n
+
+# Each state is its own copy, even of repeated steps
+assert states[1] is not states[3] and states[1]['X'] is not states[3]['X']
+states[1]['X'].append('changed')
+assert states[3]['X'] == expected(5)['X']
+
+# Only the given names
+for n, state in zip(steps, recording.states(steps, names=['D', 'i'])):
+    assert state == expected(n, names=['D', 'i']), n
+
+assert recording.states([]) == []
+print('OK')
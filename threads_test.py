@@ -0,0 +1,61 @@
+import sys
+import random
+import threading
+import execorder
+
+code = '''
+class P:
+    pass
+
+p = P()
+X = [0] * 20
+D = {}
+for i in range(10000):
+    X[i % 20] = i
+    D[i % 7] = [i, X[(i + 1) % 20]]
+    p.a = i
+'''
+
+def shown(state):
+    return repr(sorted((name, vars(value) if name == 'p' else value)
+                       for name, value in state.items() if name in ('p', 'X', 'D', 'i')))
+
+recording = execorder.exec(code)
+N = recording.steps()
+
+# Several threads querying the one recording at the same time
+got, errors = [], []
+def query(seed):
+    rnd = random.Random(seed)
+    cursor = recording.cursor()
+    try:
+        for _ in range(10):
+            n = rnd.randrange(N)
+            got.append((n, None, shown(recording.state(n))))
+            n = rnd.randrange(N)
+            got.append((n, ['X', 'p'], shown(recording.state(n, names=['X', 'p']))))
+            n = rnd.randrange(N)
+            got.append((n, None, shown(dict(recording.state(n, lazy=True)))))
+            n = rnd.randrange(N)
+            got.append((n, None, shown(cursor.seek(n))))
+            recording.find_change('X[3]', after=rnd.randrange(N))
+    except Exception as e:
+        errors.append(repr(e))
+
+sys.setswitchinterval(1e-5)
+threads = [threading.Thread(target=query, args=(seed,)) for seed in range(6)]
+for thread in threads:
+    thread.start()
+for thread in threads:
+    thread.join()
+assert not errors, errors[:3]
+assert len(got) == 6 * 10 * 4
+
+# Each thread got the states computed the plain way
+reference = execorder.exec(code)
+reference.cache_bytes = 0
+for n, names, value in got:
+    expected = shown(reference.state(n, names=names))
+    assert value == expected, (n, names, value[:200], expected[:200])
+
+print('OK')
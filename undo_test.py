@@ -0,0 +1,69 @@
+import copy
+import execorder
+
+# A function with more locals than fit in one byte of oparg, and dicts keyed
+# by objects whose priors can't be looked up without running user code
+code = '''
+class Key:
+    def __init__(self, k):
+        self.k = k
+    def __hash__(self):
+        return hash(self.k)
+    def __eq__(self, other):
+        return isinstance(other, Key) and self.k == other.k
+
+def many():
+%s
+    for i in range(3):
+        v0 = i
+        v299 = [v0, i * 2]
+        v299[0] = -i
+    return v299
+
+D = {Key(1): 'a'}
+for i in range(4):
+    D[i] = i
+    D[Key(1)] = i
+E = {(1, 'x'): 0}
+for i in range(3):
+    E[(1, 'x')] += i
+    E[i] = [i]
+R = many()
+''' % '\n'.join('    v%d = %d' % (i, i) for i in range(300))
+
+recording = execorder.exec(code)
+N = recording.steps()
+
+# States computed the plain way: a recording replayed forwards only
+reference = execorder.exec(code)
+reference.cache_bytes = 0
+expected = [copy.deepcopy(reference.state(n)) for n in range(N)]
+for state in expected:
+    state.pop('__builtins__', None)
+
+def same(state, n):
+    state = dict(state)
+    state.pop('__builtins__', None)
+    for name in set(state) | set(expected[n]):
+        a, b = state.get(name), expected[n].get(name)
+        if name in ('D', 'Key') or callable(a):
+            assert (name in state) == (name in expected[n]), (n, name)
+        elif type(a).__name__ == 'Key':
+            assert vars(a) == vars(b), (n, name, vars(a), vars(b))
+        else:
+            assert a == b, (n, name, a, b)
+    if 'D' in expected[n]:
+        assert sorted(map(repr, state['D'].values())) == sorted(map(repr, expected[n]['D'].values())), n
+
+# Seeking backwards a step at a time undoes mutations rather than replaying forwards
+cursor = recording.cursor()
+cursor.seek(N - 1)
+for n in range(N - 1, -1, -1):
+    same(cursor.seek(n), n)
+
+# And in jumps, forwards and back
+for n in list(range(0, N, 37)) + list(range(N - 1, 0, -53)):
+    same(cursor.seek(n), n)
+    same(recording.state(n), n)
+
+print('OK')
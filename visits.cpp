@@ -0,0 +1,120 @@
+#include "visits.h"
+
+static const PostingList empty_postings;
+
+static const PostingList& postings(VisitsViewObject* self){
+    auto& visits = self->recording->visits;
+    if(self->line <= 0 || self->line > (long)visits.size()){
+        return empty_postings;
+    }
+    return visits[self->line - 1];
+}
+
+static PyObject* VisitsView_materialize(VisitsViewObject* self){
+    // The recording may still be growing, so rebuild if more visits arrived
+    auto& list = postings(self);
+    if(self->materialized == NULL || PyList_GET_SIZE(self->materialized) != (Py_ssize_t)list.size()){
+        Py_XDECREF(self->materialized);
+        self->materialized = PyList_New(list.size());
+        Py_ssize_t i = 0;
+        list.each(0, list.size(), [&](size_t step){
+            PyList_SET_ITEM(self->materialized, i++, PyLong_FromSize_t(step));
+        });
+    }
+    return self->materialized;
+}
+
+static void VisitsView_dealloc(VisitsViewObject* self){
+    Py_DECREF(self->recording);
+    Py_XDECREF(self->materialized);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static Py_ssize_t VisitsView_length(VisitsViewObject* self){
+    return (Py_ssize_t)postings(self).size();
+}
+
+static PyObject* VisitsView_item(VisitsViewObject* self, Py_ssize_t i){
+    auto& list = postings(self);
+    if(i < 0 || i >= (Py_ssize_t)list.size()){
+        PyErr_SetString(PyExc_IndexError, "visits index out of range");
+        return NULL;
+    }
+    return PyLong_FromSize_t(list[i]);
+}
+
+static PyObject* VisitsView_subscript(VisitsViewObject* self, PyObject* key){
+    if(PySlice_Check(key)){
+        return PyObject_GetItem(VisitsView_materialize(self), key);
+    }
+    auto i = PyNumber_AsSsize_t(key, PyExc_IndexError);
+    if(i == -1 && PyErr_Occurred()){
+        return NULL;
+    }
+    if(i < 0){
+        i += VisitsView_length(self);
+    }
+    return VisitsView_item(self, i);
+}
+
+static PyObject* VisitsView_iter(VisitsViewObject* self){
+    return PyObject_GetIter(VisitsView_materialize(self));
+}
+
+static PyObject* VisitsView_repr(VisitsViewObject* self){
+    return PyObject_Repr(VisitsView_materialize(self));
+}
+
+static PyObject* VisitsView_richcompare(VisitsViewObject* self, PyObject* other, int op){
+    if(Py_TYPE(other) == VisitsView_Type()){
+        other = VisitsView_materialize((VisitsViewObject*)other);
+    }
+    if(!PyList_Check(other)){
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    return PyObject_RichCompare(VisitsView_materialize(self), other, op);
+}
+
+static PySequenceMethods VisitsView_sequence = {
+    (lenfunc) VisitsView_length,                /* sq_length */
+    0, 0,
+    (ssizeargfunc) VisitsView_item,             /* sq_item */
+};
+
+static PyMappingMethods VisitsView_mapping = {
+    (lenfunc) VisitsView_length,                /* mp_length */
+    (binaryfunc) VisitsView_subscript,          /* mp_subscript */
+};
+
+static PyTypeObject VisitsViewType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "execorder.VisitsView",
+    sizeof(VisitsViewObject),
+    0,
+    (destructor) VisitsView_dealloc,            /* tp_dealloc */
+    0, 0, 0, 0,
+    (reprfunc) VisitsView_repr,                 /* tp_repr */
+    0,
+    &VisitsView_sequence,                       /* tp_as_sequence */
+    &VisitsView_mapping,                        /* tp_as_mapping */
+    0, 0, 0, 0, 0, 0,
+    Py_TPFLAGS_DEFAULT,                         /* tp_flags */
+    "Steps that visited a line of a recording", /* tp_doc */
+    0, 0,
+    (richcmpfunc) VisitsView_richcompare,       /* tp_richcompare */
+    0,
+    (getiterfunc) VisitsView_iter,              /* tp_iter */
+};
+
+PyTypeObject* VisitsView_Type(){
+    return &VisitsViewType;
+}
+
+PyObject* VisitsView_New(RecordingObject* recording, long line){
+    auto self = PyObject_New(VisitsViewObject, &VisitsViewType);
+    Py_INCREF(recording);
+    self->recording = recording;
+    self->line = line;
+    self->materialized = NULL;
+    return (PyObject*)self;
+}
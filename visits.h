@@ -0,0 +1,15 @@
+#pragma once
+#include "Python.h"
+#include "recording.h"
+
+// ==== class VisitsView ====================
+// Read only sequence of the steps that visited one line, decoded on demand
+typedef struct {
+    PyObject_HEAD
+    RecordingObject*        recording;
+    long                    line;
+    PyObject*               materialized;   // List of all steps, built when first needed
+} VisitsViewObject;
+
+PyObject* VisitsView_New(RecordingObject* recording, long line);
+PyTypeObject* VisitsView_Type(void);